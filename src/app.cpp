@@ -1,14 +1,141 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <streambuf>
 #include <string>
 #include <regex>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <inja.hpp>
 #include <httplib.h>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
+#include <spdlog/async.h>
+#include <spdlog/sinks/basic_file_sink.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
 
 #include "app.hpp"
+#include "compression.hpp"
 #include "config.hpp"
 #include "image_source.hpp"
+#include "request_timer.hpp"
+#include "trace.hpp"
+
+constexpr const char* PRESENT_CACHE_CONTROL = "public, max-age=86400";
+constexpr const char* FALLBACK_CACHE_CONTROL = "public, max-age=60";
+// Number of photos in a page of search results.
+constexpr size_t SEARCH_PAGE_SIZE = 100;
+
+volatile std::sig_atomic_t shutdown_requested = 0;
+
+void onShutdownSignal([[maybe_unused]] int signal)
+{
+    shutdown_requested = 1;
+}
+
+// Size of the chunks of a streamed page. The page is also flushed
+// where the template calls “flush()”.
+constexpr size_t PAGE_CHUNK_SIZE = 16 * 1024;
+// Size of the chunks an original photo is read and sent in.
+constexpr size_t ORIGINAL_CHUNK_SIZE = 64 * 1024;
+
+// The stream of the page being rendered on this thread, for the
+// “flush()” template callback.
+thread_local std::ostream* render_stream = nullptr;
+
+// A stream buffer that writes to the data sink of a chunked response
+// through a compressor, one chunk per flush or per full buffer. The
+// data sink of httplib has its own stream, but it is unbuffered, and
+// would send every little piece of the rendered template as a chunk.
+class SinkBuffer : public std::streambuf
+{
+public:
+    SinkBuffer() = delete;
+    SinkBuffer(httplib::DataSink& s, StreamCompressor& c)
+            : sink(s), compressor(c)
+    {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+    SinkBuffer(const SinkBuffer&) = delete;
+    SinkBuffer& operator=(const SinkBuffer&) = delete;
+
+    // Send the end of the compressed stream.
+    bool finish()
+    {
+        if(sync() != 0)
+        {
+            return false;
+        }
+        auto rest = compressor.finish();
+        return rest.has_value() && send(*rest);
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        // The compressor does not need to be flushed when the buffer
+        // is full, which would hurt compression.
+        if(!sendBuffer(false))
+        {
+            return traits_type::eof();
+        }
+        if(!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        return sendBuffer(true) ? 0 : -1;
+    }
+
+private:
+    bool sendBuffer(bool flush)
+    {
+        auto compressed = compressor.write(
+            std::string_view(pbase(), pptr() - pbase()), flush);
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return compressed.has_value() && send(*compressed);
+    }
+
+    bool send(const std::string& data)
+    {
+        if(data.empty())
+        {
+            return true;
+        }
+        // The provider runs on the thread handling the request, whose
+        // timer is read by the access log.
+        if(!sink.write(data.data(), data.size()))
+        {
+            return false;
+        }
+        RequestTimer::current().addStreamed(data.size());
+        return true;
+    }
+
+    httplib::DataSink& sink;
+    StreamCompressor& compressor;
+    std::array<char, PAGE_CHUNK_SIZE> buffer;
+};
 
 nlohmann::json navChainToJson(std::vector<IDWithName>&& chain)
 {
@@ -22,7 +149,8 @@ nlohmann::json navChainToJson(std::vector<IDWithName>&& chain)
 }
 
 App::App(const Configuration& conf)
-        : config(conf), templates(conf.template_dir), image_source(conf)
+        : config(conf), templates(conf.template_dir), static_assets(conf),
+          image_source(conf)
 {
     templates.add_callback("url_for_album", 1, [&](const inja::Arguments& args)
     {
@@ -34,6 +162,13 @@ App::App(const Configuration& conf)
         return urlForPhoto(args.at(0)->get_ref<const std::string&>(), config);
     });
 
+    templates.add_callback("url_for_original", 1,
+                           [&](const inja::Arguments& args)
+    {
+        return urlForOriginal(args.at(0)->get_ref<const std::string&>(),
+                              config);
+    });
+
     templates.add_callback("url_for_repr", 2, [&](const inja::Arguments& args)
     {
         auto repr = Representation::fromStr(
@@ -48,16 +183,107 @@ App::App(const Configuration& conf)
 
     templates.add_callback("url_for_static", 1, [&](const inja::Arguments& args)
     {
-        return urlForStatic(args.at(0)->get_ref<const std::string&>(), config);
+        return urlForStatic(static_assets.fingerprintedPath(
+                                args.at(0)->get_ref<const std::string&>()),
+                            config);
+    });
+
+    // Empty if search is disabled.
+    templates.add_callback("url_for_search", 0,
+                           [&]([[maybe_unused]] const inja::Arguments& args)
+    {
+        return config.search_index ? urlForSearch("", 0, config) :
+            std::string();
+    });
+
+    // Album summaries and placeholders are looked up while the album
+    // page is being streamed, so that the items already rendered can
+    // be sent in the meantime.
+    templates.add_callback("album_summary", 1, [&](const inja::Arguments& args)
+    {
+        nlohmann::json result = {
+            {"photo_count", 0}, {"cover", "default-cover.svg"},
+            {"cover_type", "static"}};
+        auto summary = image_source.albumSummary(
+            args.at(0)->get_ref<const std::string&>());
+        if(summary.has_value())
+        {
+            result["photo_count"] = summary->photo_count;
+        }
+        if(summary.has_value() && summary->cover.has_value())
+        {
+            result["cover"] = *summary->cover;
+            result["cover_type"] = "image";
+        }
+        return result;
+    });
+
+    templates.add_callback("placeholder", 1, [&](const inja::Arguments& args)
+    {
+        auto placeholder = image_source.getPlaceholder(
+            args.at(0)->get_ref<const std::string&>());
+        if(!placeholder.has_value())
+        {
+            return nlohmann::json();
+        }
+        return placeholder->toJson();
+    });
+
+    // Send what has been rendered so far.
+    templates.add_void_callback(
+        "flush", 0, []([[maybe_unused]] const inja::Arguments& args)
+    {
+        if(render_stream != nullptr)
+        {
+            render_stream->flush();
+        }
     });
 }
 
+// Scale the size of a thumbnail placeholder to the estimated size of
+// the presentation. If the thumbnail is smaller than the thumbnail
+// size, so is the photo, and the presentation is of the same size.
+void scaleToPresent(Placeholder& placeholder, const Configuration& config)
+{
+    const uint32_t longest = std::max(placeholder.width, placeholder.height);
+    if(longest >= config.thumb_size)
+    {
+        const double scale = static_cast<double>(config.present_size) /
+            longest;
+        placeholder.width = std::lround(placeholder.width * scale);
+        placeholder.height = std::lround(placeholder.height * scale);
+    }
+}
+
+void App::setPageContent(const httplib::Request& req, httplib::Response& res,
+                         std::string&& page) const
+{
+    res.set_header("Vary", "Accept-Encoding");
+    const ContentEncoding::Value encoding = ContentEncoding::negotiate(
+        req.get_header_value("Accept-Encoding"), config);
+    if(encoding != ContentEncoding::IDENTITY &&
+       page.size() >= config.compress_min_bytes)
+    {
+        auto compressed = compress(page, encoding, config);
+        if(compressed.has_value())
+        {
+            res.set_header("Content-Encoding",
+                           std::string(ContentEncoding::toStr(encoding)));
+            res.set_content(*std::move(compressed), "text/html");
+            return;
+        }
+        spdlog::error("Failed to compress page: {}", compressed.error());
+    }
+    res.set_content(std::move(page), "text/html");
+}
+
 void App::handleIndex(httplib::Response& res) const
 {
     res.set_redirect(urlForAlbum("", config));
 }
 
-void App::handleAlbum(const std::string& id, httplib::Response& res)
+void App::handleAlbum(const std::string& id, const httplib::Request& req,
+                      httplib::Response& res)
 {
     nlohmann::json fe_data;
     fe_data["images"] = nlohmann::json::value_t::array;
@@ -74,25 +300,11 @@ void App::handleAlbum(const std::string& id, httplib::Response& res)
         return;
     }
 
-    for(const std::string& album: orderedIDsFromIDWithPath(*albums))
+    for(const std::string& album: orderedIDsFromIDWithPath(**albums))
     {
-        auto cover = image_source.albumCover(album);
-        if(cover.has_value())
-        {
-            fe_data["albums"].push_back(
-                {{"id", album},
-                 {"name", std::filesystem::path(album).filename().string()},
-                 {"cover", *cover},
-                 {"cover_type", "image"}});
-        }
-        else
-        {
-            fe_data["albums"].push_back(
-                {{"id", album},
-                 {"name", std::filesystem::path(album).filename().string()},
-                 {"cover", "default-cover.svg"},
-                 {"cover_type", "static"}});
-        }
+        fe_data["albums"].push_back({
+            {"id", album},
+            {"name", std::filesystem::path(album).filename().string()}});
     }
     auto images = image_source.images(id);
     if(!images.has_value())
@@ -101,17 +313,74 @@ void App::handleAlbum(const std::string& id, httplib::Response& res)
         res.set_content("Not found.", "text/plain");
         return;
     }
-    for(const std::string& img: orderedIDsFromIDWithPath(*images))
+    const auto image_ids = orderedIDsFromIDWithPath(**images);
+    for(size_t i = 0; i < image_ids.size(); i++)
     {
-        fe_data["images"].push_back({{ "id", img }});
+        nlohmann::json image_data = {{ "id", image_ids[i].get() }};
+        if(config.album_sprites)
+        {
+            const size_t page = i / config.sprite_page_size;
+            const size_t cell = i % config.sprite_page_size;
+            image_data["sprite"] = {
+                {"url", urlForSprite(id, page, config)},
+                {"x", cell % SPRITE_COLUMNS * config.thumb_size},
+                {"y", cell / SPRITE_COLUMNS * config.thumb_size}};
+        }
+        fe_data["images"].push_back(std::move(image_data));
     }
     fe_data["navigation"] = navChainToJson(image_source.navChain(id));
-    std::string result = templates.render_file(
-        "index.html", std::move(fe_data));
-    res.set_content(result, "text/html");
+
+    // The page is streamed, so that the browser can start on the head
+    // and the first items while the rest is still being rendered. The
+    // provider is called after this function returns, on the same
+    // thread.
+    auto page = std::make_shared<inja::Template>(
+        templates.parse_template("index.html"));
+    auto data = std::make_shared<nlohmann::json>(std::move(fe_data));
+    const ContentEncoding::Value encoding = ContentEncoding::negotiate(
+        req.get_header_value("Accept-Encoding"), config);
+    res.set_header("Vary", "Accept-Encoding");
+    if(encoding != ContentEncoding::IDENTITY)
+    {
+        res.set_header("Content-Encoding",
+                       std::string(ContentEncoding::toStr(encoding)));
+    }
+    res.set_chunked_content_provider(
+        "text/html",
+        [this, page, data, encoding](size_t, httplib::DataSink& sink)
+        {
+            StreamCompressor compressor(encoding, config);
+            SinkBuffer buffer(sink, compressor);
+            std::ostream out(&buffer);
+            render_stream = &out;
+            try
+            {
+                PhaseTimer timer(RequestTimer::RENDER);
+                TRACE_SCOPE("render index.html");
+                templates.render_to(out, *page, *data);
+                out.flush();
+            }
+            catch(const std::exception& e)
+            {
+                // Too late to change the status. Drop the connection
+                // so that the page is not taken as complete.
+                spdlog::error("Failed to render album {}: {}",
+                              data->at("id").get<std::string>(), e.what());
+                render_stream = nullptr;
+                return false;
+            }
+            render_stream = nullptr;
+            if(!out || !buffer.finish())
+            {
+                return false;
+            }
+            sink.done();
+            return true;
+        });
 }
 
-void App::handlePhoto(const std::string& id, httplib::Response& res)
+void App::handlePhoto(const std::string& id, const httplib::Request& req,
+                      httplib::Response& res)
 {
     if(!image_source.image(id).has_value())
     {
@@ -129,16 +398,215 @@ void App::handlePhoto(const std::string& id, httplib::Response& res)
         fe_data["metadata"] = *std::move(metadata);
     }
     fe_data["navigation"] = navChainToJson(image_source.navChain(id));
-    std::string result = templates.render_file(
-        "photo.html", std::move(fe_data));
-    res.set_content(result, "text/html");
+    auto placeholder = image_source.getPlaceholder(id);
+    if(placeholder.has_value())
+    {
+        scaleToPresent(*placeholder, config);
+        fe_data["placeholder"] = placeholder->toJson();
+    }
+
+    // The presentation of this photo is needed right away, and the
+    // one of the next photo is likely needed soon.
+    std::string links = std::format(
+        "<{}>; rel=preload; as=image",
+        urlForRepr(id, Representation::PRESENT, config));
+    Neighbours neighbours = image_source.neighbours(id);
+    if(neighbours.prev.has_value())
+    {
+        fe_data["prev"] = *neighbours.prev;
+    }
+    if(neighbours.next.has_value())
+    {
+        fe_data["next"] = *neighbours.next;
+        links += std::format(
+            ", <{}>; rel=prefetch; as=image",
+            urlForRepr(*neighbours.next, Representation::PRESENT, config));
+        if(config.pregenerate_next)
+        {
+            image_source.pregeneratePresent(*neighbours.next);
+        }
+    }
+    res.set_header("Link", links);
+
+    std::string result;
+    {
+        PhaseTimer timer(RequestTimer::RENDER);
+        TRACE_SCOPE("render photo.html");
+        result = templates.render_file("photo.html", std::move(fe_data));
+    }
+    setPageContent(req, res, std::move(result));
+}
+
+void App::handleSearch(const httplib::Request& req, httplib::Response& res)
+{
+    const std::string query = req.get_param_value("q");
+    size_t page = 0;
+    if(req.has_param("page"))
+    {
+        const std::string value = req.get_param_value("page");
+        auto status = std::from_chars(value.data(), value.data() + value.size(),
+                                      page);
+        if(status.ec != std::errc() ||
+           page > std::numeric_limits<size_t>::max() / SEARCH_PAGE_SIZE - 1)
+        {
+            res.status = httplib::StatusCode::BadRequest_400;
+            res.set_content("Invalid page.", "text/plain");
+            return;
+        }
+    }
+    SearchIndex::Result result = image_source.search(
+        query, page * SEARCH_PAGE_SIZE, SEARCH_PAGE_SIZE);
+
+    nlohmann::json fe_data;
+    // Templates are not escaped automatically.
+    fe_data["query"] = htmlEscape(query);
+    fe_data["total"] = result.total;
+    fe_data["url_prefix"] = config.url_prefix;
+    fe_data["navigation"] = nlohmann::json::array({
+            {{"id", ""}, {"name", "Search"}}});
+    fe_data["images"] = nlohmann::json::value_t::array;
+    for(const std::string& id: result.ids)
+    {
+        // The index is only updated periodically, so the photo may be
+        // gone or no longer listed.
+        if(!image_source.image(id).has_value())
+        {
+            continue;
+        }
+        fe_data["images"].push_back({{"id", id}});
+    }
+    if(page > 0)
+    {
+        fe_data["prev"] = urlForSearch(query, page - 1, config);
+    }
+    if((page + 1) * SEARCH_PAGE_SIZE < result.total)
+    {
+        fe_data["next"] = urlForSearch(query, page + 1, config);
+    }
+
+    std::string rendered;
+    {
+        PhaseTimer timer(RequestTimer::RENDER);
+        TRACE_SCOPE("render search.html");
+        rendered = templates.render_file("search.html", std::move(fe_data));
+    }
+    setPageContent(req, res, std::move(rendered));
+}
+
+std::string_view originalContentType(const std::filesystem::path& path)
+{
+    const std::string ext = asciiLower(path.extension().string());
+    if(ext == ".jpg" || ext == ".jpeg")
+    {
+        return "image/jpeg";
+    }
+    if(ext == ".png")
+    {
+        return "image/png";
+    }
+    if(ext == ".tif" || ext == ".tiff")
+    {
+        return "image/tiff";
+    }
+    if(ext == ".webp")
+    {
+        return "image/webp";
+    }
+    if(ext == ".avif")
+    {
+        return "image/avif";
+    }
+    return "application/octet-stream";
 }
 
-void App::handleRepresentation(const std::string& path, httplib::Response& res)
+void App::handleOriginal(const std::string& id, const httplib::Request& req,
+                         httplib::Response& res)
 {
-    std::regex p(std::format(R"((.*)-(thumb\.{}|present\.{}))",
+    // This goes through the listings, so excluded and hidden photos
+    // are treated the same as on their pages.
+    auto path = image_source.image(id);
+    if(!path.has_value())
+    {
+        res.status = httplib::StatusCode::NotFound_404;
+        res.set_content("Not found.", "text/plain");
+        return;
+    }
+    int fd = open(path->c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        spdlog::error("Failed to open {}: {}", path->string(),
+                      std::strerror(errno));
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        res.status = httplib::StatusCode::InternalServerError_500;
+        res.set_content("Failed to open photo.", "text/plain");
+        return;
+    }
+
+    const std::string etag = std::format(
+        "\"{:x}-{:x}-{:x}\"", info.st_size, info.st_mtim.tv_sec,
+        info.st_mtim.tv_nsec);
+    res.set_header("ETag", etag);
+    res.set_header("Accept-Ranges", "bytes");
+    if(req.get_header_value("If-None-Match") == etag)
+    {
+        close(fd);
+        res.status = httplib::StatusCode::NotModified_304;
+        return;
+    }
+    if(req.has_header("If-Range") && req.get_header_value("If-Range") != etag)
+    {
+        // The file changed since the client got the first part, so
+        // the whole file is sent. httplib applies the requested ranges
+        // to any response with a content length, and does not look at
+        // If-Range, so the ranges are dropped here. The request object
+        // is not const in httplib, only the reference is.
+        const_cast<httplib::Request&>(req).ranges.clear();
+    }
+
+    // The file is read in chunks as it is sent, so it is never
+    // buffered in memory, and only the requested part is read. It is
+    // not mapped, because reading a mapping of a file that is
+    // truncated in the meantime (e.g. while it is being replaced)
+    // would crash the server.
+    auto file = std::shared_ptr<int>(new int(fd), [](int* p)
+    {
+        close(*p);
+        delete p;
+    });
+    res.set_content_provider(
+        info.st_size, std::string(originalContentType(*path)),
+        [file](size_t offset, size_t length, httplib::DataSink& sink)
+        {
+            std::array<char, ORIGINAL_CHUNK_SIZE> buffer;
+            ssize_t size;
+            do
+            {
+                size = pread(*file, buffer.data(),
+                             std::min(length, buffer.size()), offset);
+            } while(size < 0 && errno == EINTR);
+            // The file is shorter than when the response started.
+            // Drop the connection, so that the download is not taken
+            // as complete.
+            if(size <= 0)
+            {
+                return false;
+            }
+            return sink.write(buffer.data(), size);
+        });
+}
+
+void App::handleRepresentation(const std::string& path,
+                               const httplib::Request& req,
+                               httplib::Response& res)
+{
+    std::regex p(std::format(R"((.*)-(thumb\.{}|present\.{}|sprite(\d+)\.{}))",
                              ImageFormat::toExt(config.thumb_format),
-                             ImageFormat::toExt(config.present_format)));
+                             ImageFormat::toExt(config.present_format),
+                             ImageFormat::toExt(config.thumb_format)));
     std::smatch match;
     if(!std::regex_match(path, match, p))
     {
@@ -147,8 +615,22 @@ void App::handleRepresentation(const std::string& path, httplib::Response& res)
         return;
     }
 
+    // Stop waiting for the image if the client is gone.
+    JobQueue::Wait wait{[&req] { return req.is_connection_closed(); },
+                        std::nullopt};
+    if(config.generation_deadline_ms > 0)
+    {
+        wait.deadline = JobQueue::Clock::now() +
+            std::chrono::milliseconds(config.generation_deadline_ms);
+    }
+
     const std::string& id = match[1];
     const std::string& repr_str = match[2];
+    if(repr_str.starts_with("sprite"))
+    {
+        handleSprite(id, match[3], wait, res);
+        return;
+    }
     Representation::Type repr;
     if(repr_str.starts_with("thumb."))
     {
@@ -171,7 +653,45 @@ void App::handleRepresentation(const std::string& path, httplib::Response& res)
     {
     case Representation::THUMB:
     {
-        auto thumb = image_source.getThumb(id);
+        if(config.thumb_pack)
+        {
+            auto blob = image_source.getPackedThumb(id, wait);
+            if(!blob.has_value() && blob.error() == JOB_TIMED_OUT)
+            {
+                handlePendingRepresentation(id, repr, res);
+                return;
+            }
+            if(!blob.has_value())
+            {
+                spdlog::error(blob.error());
+                res.status = httplib::StatusCode::InternalServerError_500;
+                res.set_content("Failed to get thumbnail.", "text/plain");
+                return;
+            }
+            const std::string etag = std::format("\"{:016x}\"", blob->etag);
+            res.set_header("ETag", etag);
+            if(req.get_header_value("If-None-Match") == etag)
+            {
+                res.status = httplib::StatusCode::NotModified_304;
+                return;
+            }
+            const size_t size = blob->size;
+            // Served directly from the mapping of the pack.
+            res.set_content_provider(
+                size, std::string(ImageFormat::contentType(config.thumb_format)),
+                [blob = *std::move(blob)](size_t offset, size_t length,
+                                          httplib::DataSink& sink)
+                {
+                    return sink.write(blob.data + offset, length);
+                });
+            return;
+        }
+        auto thumb = image_source.getThumb(id, wait);
+        if(!thumb.has_value() && thumb.error() == JOB_TIMED_OUT)
+        {
+            handlePendingRepresentation(id, repr, res);
+            return;
+        }
         if(!thumb.has_value())
         {
             res.status = httplib::StatusCode::InternalServerError_500;
@@ -184,15 +704,27 @@ void App::handleRepresentation(const std::string& path, httplib::Response& res)
     }
     case Representation::PRESENT:
     {
-        auto present = image_source.getPresent(id);
+        auto present = image_source.getPresentOrFallback(id, wait);
+        if(!present.has_value() && present.error() == JOB_TIMED_OUT)
+        {
+            handlePendingRepresentation(id, repr, res);
+            return;
+        }
         if(!present.has_value())
         {
             res.status = httplib::StatusCode::InternalServerError_500;
             res.set_content("Failed to get presentation.", "text/plain");
             return;
         }
-        content = readFile(*present);
-        content_type = ImageFormat::contentType(config.present_format);
+        content = readFile(present->path);
+        content_type = ImageFormat::contentType(present->format);
+        if(config.present_fallback_format.has_value())
+        {
+            // A fallback should be replaced by the real presentation
+            // soon, so it must not be cached for long.
+            res.set_header("Cache-Control", present->final ?
+                           PRESENT_CACHE_CONTROL : FALLBACK_CACHE_CONTROL);
+        }
         break;
     }
     }
@@ -210,15 +742,258 @@ void App::handleRepresentation(const std::string& path, httplib::Response& res)
     }
 }
 
+void App::handlePendingRepresentation(const std::string& id,
+                                      Representation::Type repr,
+                                      httplib::Response& res)
+{
+    uint32_t width = config.thumb_size;
+    uint32_t height = config.thumb_size;
+    std::string image;
+    if(repr == Representation::PRESENT)
+    {
+        width = config.present_size;
+        height = config.present_size;
+        auto placeholder = image_source.getPlaceholder(id);
+        if(placeholder.has_value())
+        {
+            scaleToPresent(*placeholder, config);
+            width = placeholder->width;
+            height = placeholder->height;
+            image = std::format(
+                R"(<image href="{}" width="100%" height="100%" )"
+                R"(preserveAspectRatio="none"/>)", placeholder->data_uri);
+        }
+    }
+    // The image is being generated. Browsers do not request it again
+    // on their own, but it must not be cached, so that the real image
+    // is shown after a reload.
+    res.set_header("Cache-Control", "no-store");
+    res.set_content(std::format(
+        R"(<svg xmlns="http://www.w3.org/2000/svg" width="{0}" height="{1}" )"
+        R"(viewBox="0 0 {0} {1}"><rect width="100%" height="100%" )"
+        R"(fill="#80808040"/>{2}</svg>)", width, height, image),
+        "image/svg+xml");
+}
+
+void App::handleStatic(const std::string& path, const httplib::Request& req,
+                       httplib::Response& res) const
+{
+    bool fingerprinted = false;
+    const StaticAsset* asset = static_assets.find(path, fingerprinted);
+    if(asset == nullptr)
+    {
+        res.status = httplib::StatusCode::NotFound_404;
+        res.set_content("Not found.", "text/plain");
+        return;
+    }
+    res.set_header("Vary", "Accept-Encoding");
+    ContentEncoding::Value encoding = ContentEncoding::negotiate(
+        req.get_header_value("Accept-Encoding"), config);
+    std::optional<std::string_view> content = asset->variant(encoding);
+    if(!content.has_value())
+    {
+        encoding = ContentEncoding::IDENTITY;
+        content = asset->content;
+    }
+    // Each encoding is a different representation, so it has its own
+    // strong ETag.
+    const std::string etag = encoding == ContentEncoding::IDENTITY ?
+        std::format("\"{}\"", asset->hash) :
+        std::format("\"{}-{}\"", asset->hash,
+                    ContentEncoding::toStr(encoding));
+    res.set_header("ETag", etag);
+    // Content at a fingerprinted path never changes. Unfingerprinted
+    // paths (e.g. linked from a cached page) are revalidated.
+    res.set_header("Cache-Control", fingerprinted ?
+                   "public, max-age=31536000, immutable" : "no-cache");
+    if(req.get_header_value("If-None-Match") == etag)
+    {
+        res.status = httplib::StatusCode::NotModified_304;
+        return;
+    }
+    if(encoding != ContentEncoding::IDENTITY)
+    {
+        res.set_header("Content-Encoding",
+                       std::string(ContentEncoding::toStr(encoding)));
+    }
+    // The asset lives as long as the app, so it is served without a
+    // copy.
+    res.set_content_provider(
+        content->size(), asset->content_type,
+        [content = *content](size_t offset, size_t length,
+                             httplib::DataSink& sink)
+        {
+            return sink.write(content.data() + offset, length);
+        });
+}
+
+void App::handleSprite(const std::string& album_id,
+                       const std::string& page_str,
+                       const JobQueue::Wait& wait, httplib::Response& res)
+{
+    size_t page = 0;
+    auto status = std::from_chars(page_str.data(),
+                                  page_str.data() + page_str.size(), page);
+    if(!config.album_sprites || status.ec != std::errc())
+    {
+        res.status = httplib::StatusCode::NotFound_404;
+        res.set_content("Not found.", "text/plain");
+        return;
+    }
+    auto sprite = image_source.getSprite(album_id, page, wait);
+    if(!sprite.has_value() && sprite.error() == JOB_TIMED_OUT)
+    {
+        // The thumbnails are still being generated.
+        res.status = httplib::StatusCode::ServiceUnavailable_503;
+        res.set_header("Cache-Control", "no-store");
+        res.set_content("Sprite is being generated.", "text/plain");
+        return;
+    }
+    if(!sprite.has_value())
+    {
+        spdlog::error(sprite.error());
+        res.status = httplib::StatusCode::NotFound_404;
+        res.set_content("Sprite not found.", "text/plain");
+        return;
+    }
+    auto content = readFile(*sprite);
+    if(!content.has_value())
+    {
+        spdlog::error(content.error());
+        res.status = httplib::StatusCode::InternalServerError_500;
+        res.set_content("Internal error", "text/plain");
+        return;
+    }
+    res.set_content(content->data(), content->size(),
+                    std::string(ImageFormat::contentType(config.thumb_format)));
+}
+
+void App::configureServer(httplib::Server& server) const
+{
+    if(config.server_threads > 0)
+    {
+        server.new_task_queue = [threads = config.server_threads]
+        {
+            return new httplib::ThreadPool(threads);
+        };
+    }
+    server.set_keep_alive_max_count(config.keep_alive_max_count);
+    server.set_keep_alive_timeout(config.keep_alive_timeout_sec);
+    server.set_read_timeout(config.read_timeout_sec);
+    server.set_write_timeout(config.write_timeout_sec);
+    if(config.payload_max_bytes > 0)
+    {
+        server.set_payload_max_length(config.payload_max_bytes);
+    }
+    if(config.worker_processes > 1)
+    {
+        // Let the worker processes listen on the same port. The kernel
+        // balances connections among them.
+        server.set_socket_options([](httplib::socket_t sock)
+        {
+            int yes = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        });
+    }
+}
+
+double toMillis(RequestTimer::Clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+void App::setupAccessLog(httplib::Server& server)
+{
+    if(config.access_log.empty() && config.slow_request_ms == 0)
+    {
+        return;
+    }
+
+    // Logging is done by the server threads after each response, so
+    // the file writes are handed to a background thread. If it falls
+    // behind, the oldest lines are dropped instead of blocking the
+    // server threads.
+    spdlog::init_thread_pool(8192, 1);
+    std::shared_ptr<spdlog::logger> logger;
+    try
+    {
+        if(config.access_log.empty())
+        {
+            logger = spdlog::create_async_nb<
+                spdlog::sinks::stdout_color_sink_mt>("access");
+        }
+        else
+        {
+            logger = spdlog::create_async_nb<
+                spdlog::sinks::basic_file_sink_mt>("access",
+                                                   config.access_log);
+        }
+    }
+    catch(const spdlog::spdlog_ex& e)
+    {
+        spdlog::error("Failed to open access log: {}", e.what());
+        return;
+    }
+    logger->set_pattern("[%Y-%m-%d %H:%M:%S.%e] %v");
+    logger->flush_on(spdlog::level::warn);
+
+    server.set_pre_routing_handler(
+        []([[maybe_unused]] const httplib::Request& req,
+           [[maybe_unused]] httplib::Response& res)
+        {
+            RequestTimer::start();
+            return httplib::Server::HandlerResponse::Unhandled;
+        });
+
+    const bool log_all = !config.access_log.empty();
+    const uint32_t slow_ms = config.slow_request_ms;
+    server.set_logger(
+        [logger, log_all, slow_ms](const httplib::Request& req,
+                                   const httplib::Response& res)
+        {
+            const RequestTimer& timer = RequestTimer::current();
+            const double total = toMillis(timer.total());
+            size_t bytes = res.body.empty() ? timer.streamedBytes() :
+                res.body.size();
+            if(res.has_header("Content-Length"))
+            {
+                std::string length = res.get_header_value("Content-Length");
+                std::from_chars(length.data(), length.data() + length.size(),
+                                bytes);
+            }
+            if(log_all)
+            {
+                logger->info("{} {} {} {} {:.1f}ms", req.method, req.path,
+                             res.status, bytes, total);
+            }
+            if(slow_ms > 0 && total >= slow_ms)
+            {
+                std::string phases;
+                for(int p = 0; p < RequestTimer::PHASE_COUNT; p++)
+                {
+                    auto phase = static_cast<RequestTimer::Phase>(p);
+                    phases += std::format(
+                        " {}={:.1f}ms", RequestTimer::phaseName(phase),
+                        toMillis(timer.phase(phase)));
+                }
+                logger->warn("Slow request: {} {} {:.1f}ms:{}", req.method,
+                             req.path, total, phases);
+            }
+        });
+}
+
 void App::start()
 {
     httplib::Server server;
-    spdlog::info("Mounting static dir at {}...", config.static_dir);
-    auto ret = server.set_mount_point("/static", config.static_dir);
-    if (!ret)
+    server.Get("/static/(.+)", [&](const httplib::Request& req,
+                                   httplib::Response& res)
     {
-        spdlog::error("Failed to mount static");
-    }
+        handleStatic(req.matches[1], req, res);
+    });
+
+    setupAccessLog(server);
+    configureServer(server);
 
     server.Get("/", [&]([[maybe_unused]] const httplib::Request& req,
                         httplib::Response& res)
@@ -228,7 +1003,7 @@ void App::start()
     server.Get("/repr/(.+)",
                [&](const httplib::Request& req, httplib:: Response& res)
                {
-                   handleRepresentation(req.matches[1], res);
+                   handleRepresentation(req.matches[1], req, res);
                });
     server.Get("/a(/.*)?", [&](const httplib::Request& req,
                                httplib::Response& res)
@@ -236,21 +1011,96 @@ void App::start()
         const std::string& match = req.matches[1];
         if(match.starts_with("/"))
         {
-            handleAlbum(match.substr(1), res);
+            handleAlbum(match.substr(1), req, res);
         }
         else
         {
-            handleAlbum(match, res);
+            handleAlbum(match, req, res);
         }
     });
 
     server.Get("/p/(.+)", [&](const httplib::Request& req,
                               httplib::Response& res)
     {
-        handlePhoto(req.matches[1], res);
+        handlePhoto(req.matches[1], req, res);
+    });
+
+    server.Get("/o/(.+)", [&](const httplib::Request& req,
+                              httplib::Response& res)
+    {
+        handleOriginal(req.matches[1], req, res);
+    });
+
+    if(config.search_index)
+    {
+        server.Get("/search", [&](const httplib::Request& req,
+                                  httplib::Response& res)
+        {
+            handleSearch(req, res);
+        });
+    }
+
+#ifdef NSGALLERY_TRACE
+    auto trace_path = std::filesystem::temp_directory_path() /
+        std::format("nsgallery-trace-{}.json", getpid());
+    installTraceSignalHandler(trace_path);
+    spdlog::info("Tracing is enabled. Send SIGUSR1 to dump the trace to {}, "
+                 "or fetch /debug/trace.", trace_path.string());
+    server.Get("/debug/trace", [&]([[maybe_unused]] const httplib::Request& req,
+                                   httplib::Response& res)
+    {
+        res.set_content(traceToJson(), "application/json");
+    });
+#endif
+
+    if(!config.cache_snapshot.empty())
+    {
+        auto loaded = image_source.loadSnapshot();
+        if(loaded.has_value())
+        {
+            spdlog::info("Loaded cache snapshot from {}.",
+                         config.cache_snapshot);
+        }
+        else
+        {
+            spdlog::warn("Cache snapshot not loaded: {}", loaded.error());
+        }
+    }
+
+    // Stop gracefully on SIGTERM and SIGINT, so that requests being
+    // handled are finished, and the caches are saved. Nothing much can
+    // be done in a signal handler, so it only sets a flag, which is
+    // checked by a thread.
+    std::signal(SIGTERM, onShutdownSignal);
+    std::signal(SIGINT, onShutdownSignal);
+    std::jthread shutdown_watcher([&server](std::stop_token stop)
+    {
+        while(!stop.stop_requested())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            if(shutdown_requested != 0 && server.is_running())
+            {
+                spdlog::info("Shutting down...");
+                server.stop();
+                return;
+            }
+        }
     });
 
     spdlog::info("Listening at http://{}:{}/...", config.listen_address,
                  config.listen_port);
     server.listen(config.listen_address, config.listen_port);
+
+    if(!config.cache_snapshot.empty())
+    {
+        auto saved = image_source.saveSnapshot();
+        if(saved.has_value())
+        {
+            spdlog::info("Saved cache snapshot to {}.", config.cache_snapshot);
+        }
+        else
+        {
+            spdlog::error("Failed to save cache snapshot: {}", saved.error());
+        }
+    }
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cctype>
 #include <string>
 #include <string_view>
 #include <format>
@@ -11,6 +12,7 @@
 #include "utils.hpp"
 #include "config.hpp"
 #include "image_source.hpp"
+#include "static_assets.hpp"
 
 inline std::string urlForAlbum(const std::string& id,
                                [[maybe_unused]] const Configuration& config)
@@ -24,6 +26,12 @@ inline std::string urlForPhoto(const std::string& id,
     return std::string("/p/") + id;
 }
 
+inline std::string urlForOriginal(const std::string& id,
+                                  [[maybe_unused]] const Configuration& config)
+{
+    return std::string("/o/") + id;
+}
+
 inline std::string urlForRepr(const std::string& id,
                               Representation::Type repr,
                               const Configuration& config)
@@ -41,6 +49,40 @@ inline std::string urlForRepr(const std::string& id,
     }
 }
 
+inline std::string urlForSprite(const std::string& album_id, size_t page,
+                                const Configuration& config)
+{
+    return std::format("/repr/{}-sprite{}.{}", album_id, page,
+                       ImageFormat::toExt(config.thumb_format));
+}
+
+inline std::string urlForSearch(std::string_view query, size_t page,
+                                [[maybe_unused]] const Configuration& config)
+{
+    std::string url = "/search";
+    if(query.empty() && page == 0)
+    {
+        return url;
+    }
+    url += "?q=";
+    for(unsigned char c: query)
+    {
+        if(std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+        {
+            url.push_back(c);
+        }
+        else
+        {
+            url += std::format("%{:02X}", c);
+        }
+    }
+    if(page > 0)
+    {
+        url += std::format("&page={}", page);
+    }
+    return url;
+}
+
 inline std::string urlForStatic(const std::string& path,
                                 [[maybe_unused]] const Configuration& config)
 {
@@ -54,13 +96,44 @@ public:
     explicit App(const Configuration& conf);
 
     void handleIndex(httplib::Response& res) const;
-    void handleAlbum(const std::string& id, httplib::Response& res);
-    void handlePhoto(const std::string& id, httplib::Response& res);
-    void handleRepresentation(const std::string& path, httplib::Response& res);
+    void handleAlbum(const std::string& id, const httplib::Request& req,
+                     httplib::Response& res);
+    void handlePhoto(const std::string& id, const httplib::Request& req,
+                     httplib::Response& res);
+    void handleSearch(const httplib::Request& req, httplib::Response& res);
+    // Serve the original file of a photo. Ranges are handled by
+    // httplib.
+    void handleOriginal(const std::string& id, const httplib::Request& req,
+                        httplib::Response& res);
+    // Generation is abandoned if the client disconnects.
+    void handleRepresentation(const std::string& path,
+                              const httplib::Request& req,
+                              httplib::Response& res);
+    // Respond with a placeholder for a representation that is still
+    // being generated.
+    void handlePendingRepresentation(const std::string& id,
+                                     Representation::Type repr,
+                                     httplib::Response& res);
+    // Serve a file in the static dir from memory.
+    void handleStatic(const std::string& path, const httplib::Request& req,
+                      httplib::Response& res) const;
+    void handleSprite(const std::string& album_id, const std::string& page,
+                      const JobQueue::Wait& wait, httplib::Response& res);
     void start();
 
 private:
+    // Log requests to the access log and slow requests with their
+    // per-phase timing, if enabled in the config.
+    void setupAccessLog(httplib::Server& server);
+    // Apply the server settings in the config.
+    void configureServer(httplib::Server& server) const;
+    // Set a rendered page as the content of “res”, compressed if the
+    // client accepts it.
+    void setPageContent(const httplib::Request& req, httplib::Response& res,
+                        std::string&& page) const;
+
     const Configuration config;
     inja::Environment templates;
+    StaticAssets static_assets;
     ImageSource image_source;
 };
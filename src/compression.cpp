@@ -0,0 +1,247 @@
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <brotli/encode.h>
+#include <zlib.h>
+
+#include "compression.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+
+// Size of the output buffer of each compression step.
+constexpr size_t COMPRESS_BUFFER_SIZE = 16 * 1024;
+
+std::string_view ContentEncoding::toStr(Value v)
+{
+    switch(v)
+    {
+    case IDENTITY:
+        return "identity";
+    case GZIP:
+        return "gzip";
+    case BROTLI:
+        return "br";
+    }
+    std::unreachable();
+}
+
+std::string_view trimSpaces(std::string_view s)
+{
+    while(!s.empty() && std::isspace(static_cast<unsigned char>(s.front())))
+    {
+        s.remove_prefix(1);
+    }
+    while(!s.empty() && std::isspace(static_cast<unsigned char>(s.back())))
+    {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+ContentEncoding::Value ContentEncoding::negotiate(
+    std::string_view accept_encoding, const Configuration& config)
+{
+    bool gzip = false;
+    bool brotli = false;
+    while(!accept_encoding.empty())
+    {
+        size_t end = accept_encoding.find(',');
+        std::string_view item = accept_encoding.substr(0, end);
+        accept_encoding.remove_prefix(
+            end == std::string_view::npos ? accept_encoding.size() : end + 1);
+
+        // An item is like “gzip” or “gzip;q=0.5”. Only q=0, which
+        // means not acceptable, matters here.
+        size_t params = item.find(';');
+        std::string_view name = trimSpaces(item.substr(0, params));
+        if(params != std::string_view::npos)
+        {
+            std::string_view q = trimSpaces(item.substr(params + 1));
+            if(q.starts_with("q="))
+            {
+                double weight = 1.0;
+                q.remove_prefix(2);
+                std::from_chars(q.data(), q.data() + q.size(), weight);
+                if(weight <= 0.0)
+                {
+                    continue;
+                }
+            }
+        }
+        if(name == "gzip")
+        {
+            gzip = true;
+        }
+        else if(name == "br")
+        {
+            brotli = true;
+        }
+    }
+    if(brotli && config.brotli_level > 0)
+    {
+        return BROTLI;
+    }
+    if(gzip && config.gzip_level > 0)
+    {
+        return GZIP;
+    }
+    return IDENTITY;
+}
+
+struct StreamCompressor::State
+{
+    ContentEncoding::Value encoding;
+    z_stream gzip{};
+    BrotliEncoderState* brotli = nullptr;
+    bool ok = false;
+};
+
+StreamCompressor::StreamCompressor(ContentEncoding::Value encoding,
+                                   const Configuration& config)
+        : state(std::make_unique<State>())
+{
+    state->encoding = encoding;
+    switch(encoding)
+    {
+    case ContentEncoding::IDENTITY:
+        state->ok = true;
+        break;
+    case ContentEncoding::GZIP:
+        // 16 + 15 means a gzip header and the largest window.
+        state->ok = deflateInit2(&state->gzip, config.gzip_level, Z_DEFLATED,
+                                 16 + 15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        break;
+    case ContentEncoding::BROTLI:
+        state->brotli = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+        state->ok = state->brotli != nullptr &&
+            BrotliEncoderSetParameter(state->brotli, BROTLI_PARAM_QUALITY,
+                                      config.brotli_level) &&
+            BrotliEncoderSetParameter(state->brotli, BROTLI_PARAM_MODE,
+                                      BROTLI_MODE_TEXT);
+        break;
+    }
+}
+
+StreamCompressor::~StreamCompressor()
+{
+    switch(state->encoding)
+    {
+    case ContentEncoding::IDENTITY:
+        break;
+    case ContentEncoding::GZIP:
+        deflateEnd(&state->gzip);
+        break;
+    case ContentEncoding::BROTLI:
+        if(state->brotli != nullptr)
+        {
+            BrotliEncoderDestroyInstance(state->brotli);
+        }
+        break;
+    }
+}
+
+// Run one compression operation on “data” until all of it is taken
+// and all output of the operation is produced.
+E<std::string> gzipStep(z_stream& stream, std::string_view data, int flush)
+{
+    std::string result;
+    char buffer[COMPRESS_BUFFER_SIZE];
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = data.size();
+    do
+    {
+        stream.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream.avail_out = sizeof(buffer);
+        int status = deflate(&stream, flush);
+        if(status == Z_STREAM_ERROR)
+        {
+            return std::unexpected("Failed to gzip");
+        }
+        result.append(buffer, sizeof(buffer) - stream.avail_out);
+    } while(stream.avail_out == 0);
+    return result;
+}
+
+E<std::string> brotliStep(BrotliEncoderState* stream, std::string_view data,
+                          BrotliEncoderOperation op)
+{
+    std::string result;
+    size_t available_in = data.size();
+    auto next_in = reinterpret_cast<const uint8_t*>(data.data());
+    do
+    {
+        uint8_t buffer[COMPRESS_BUFFER_SIZE];
+        size_t available_out = sizeof(buffer);
+        uint8_t* next_out = buffer;
+        if(!BrotliEncoderCompressStream(stream, op, &available_in, &next_in,
+                                        &available_out, &next_out, nullptr))
+        {
+            return std::unexpected("Failed to compress with brotli");
+        }
+        result.append(reinterpret_cast<const char*>(buffer),
+                      sizeof(buffer) - available_out);
+    } while(available_in > 0 || BrotliEncoderHasMoreOutput(stream) ||
+            (op == BROTLI_OPERATION_FINISH && !BrotliEncoderIsFinished(stream)));
+    return result;
+}
+
+E<std::string> StreamCompressor::write(std::string_view data, bool flush)
+{
+    if(!state->ok)
+    {
+        return std::unexpected("Failed to initialize compressor");
+    }
+    switch(state->encoding)
+    {
+    case ContentEncoding::IDENTITY:
+        return std::string(data);
+    case ContentEncoding::GZIP:
+        return gzipStep(state->gzip, data, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    case ContentEncoding::BROTLI:
+        return brotliStep(state->brotli, data,
+                          flush ? BROTLI_OPERATION_FLUSH :
+                          BROTLI_OPERATION_PROCESS);
+    }
+    std::unreachable();
+}
+
+E<std::string> StreamCompressor::finish()
+{
+    if(!state->ok)
+    {
+        return std::unexpected("Failed to initialize compressor");
+    }
+    switch(state->encoding)
+    {
+    case ContentEncoding::IDENTITY:
+        return std::string();
+    case ContentEncoding::GZIP:
+        return gzipStep(state->gzip, {}, Z_FINISH);
+    case ContentEncoding::BROTLI:
+        return brotliStep(state->brotli, {}, BROTLI_OPERATION_FINISH);
+    }
+    std::unreachable();
+}
+
+E<std::string> compress(std::string_view data, ContentEncoding::Value encoding,
+                        const Configuration& config)
+{
+    StreamCompressor compressor(encoding, config);
+    auto result = compressor.write(data, false);
+    if(!result.has_value())
+    {
+        return result;
+    }
+    auto rest = compressor.finish();
+    if(!rest.has_value())
+    {
+        return rest;
+    }
+    *result += *rest;
+    return result;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "config.hpp"
+#include "utils.hpp"
+
+// Content encodings of compressed responses.
+struct ContentEncoding
+{
+    enum Value { IDENTITY, GZIP, BROTLI };
+
+    ContentEncoding() = delete;
+    // The name in Accept-Encoding and Content-Encoding.
+    static std::string_view toStr(Value v);
+    // Choose an encoding from the value of an Accept-Encoding header,
+    // among those enabled in the config. Brotli is preferred, since it
+    // compresses HTML better.
+    static Value negotiate(std::string_view accept_encoding,
+                           const Configuration& config);
+};
+
+// Compress “data” with the level of “encoding” in the config.
+E<std::string> compress(std::string_view data, ContentEncoding::Value encoding,
+                        const Configuration& config);
+
+// Compresses a stream of data piece by piece, for streamed responses.
+class StreamCompressor
+{
+public:
+    StreamCompressor() = delete;
+    StreamCompressor(ContentEncoding::Value encoding,
+                     const Configuration& config);
+    StreamCompressor(const StreamCompressor&) = delete;
+    StreamCompressor& operator=(const StreamCompressor&) = delete;
+    ~StreamCompressor();
+
+    // Compress “data”, and return the compressed data available so
+    // far. If “flush” is true, all of “data” is in the output, so that
+    // the client can decode it right away.
+    E<std::string> write(std::string_view data, bool flush);
+    // End the stream, and return the rest of the compressed data.
+    E<std::string> finish();
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
@@ -58,6 +58,20 @@ std::string_view ImageFormat::contentType(Value v)
     std::unreachable();
 }
 
+std::string_view ImageFormat::toMagick(Value v)
+{
+    switch(v)
+    {
+    case JPEG:
+        return "JPEG";
+    case WEBP:
+        return "WEBP";
+    case AVIF:
+        return "AVIF";
+    }
+    std::unreachable();
+}
+
 E<Configuration> Configuration::fromYaml(const std::filesystem::path& path)
 {
     auto buffer = readFile(path);
@@ -153,11 +167,29 @@ E<Configuration> Configuration::fromYaml(const std::filesystem::path& path)
             config.present_format = *f;
         }
     }
+    if(tree["present-fallback-format"].has_key())
+    {
+        auto value = tree["present-fallback-format"].val();
+        std::string s(value.begin(), value.end());
+        auto f = ImageFormat::fromStr(std::move(s));
+        if(!f.has_value())
+        {
+            return std::unexpected("Invalid present fallback format");
+        }
+        config.present_fallback_format = *f;
+    }
     if(tree["exiftool-path"].has_key())
     {
         auto value = tree["exiftool-path"].val();
         config.exiftool_path = std::string(value.begin(), value.end());
     }
+    if(tree["raw-files"].has_key())
+    {
+        if(!getYamlBool(tree["raw-files"], config.raw_files))
+        {
+            return std::unexpected("Invalid RAW files");
+        }
+    }
     if(tree["imagemagick-mem-limit-mib"].has_key())
     {
         if(!getYamlValue(tree["imagemagick-mem-limit-mib"],
@@ -166,6 +198,225 @@ E<Configuration> Configuration::fromYaml(const std::filesystem::path& path)
             return std::unexpected("Invalid magick mem limit");
         }
     }
+    if(tree["decode-budget-mib"].has_key())
+    {
+        if(!getYamlValue(tree["decode-budget-mib"], config.decode_budget_mib))
+        {
+            return std::unexpected("Invalid decode budget");
+        }
+    }
+    if(tree["generation-threads"].has_key())
+    {
+        if(!getYamlValue(tree["generation-threads"], config.generation_threads))
+        {
+            return std::unexpected("Invalid generation threads");
+        }
+    }
+    if(tree["generation-deadline-ms"].has_key())
+    {
+        if(!getYamlValue(tree["generation-deadline-ms"],
+                         config.generation_deadline_ms))
+        {
+            return std::unexpected("Invalid generation deadline");
+        }
+    }
+    if(tree["cache-dir"].has_key())
+    {
+        auto value = tree["cache-dir"].val();
+        config.cache_dir = std::string(value.begin(), value.end());
+    }
+    if(tree["content-dedup"].has_key())
+    {
+        if(!getYamlBool(tree["content-dedup"], config.content_dedup))
+        {
+            return std::unexpected("Invalid content dedup");
+        }
+    }
+    if(tree["metadata-preload-album"].has_key())
+    {
+        if(!getYamlBool(tree["metadata-preload-album"],
+                        config.metadata_preload_album))
+        {
+            return std::unexpected("Invalid metadata preload");
+        }
+    }
+    if(tree["pregenerate-next"].has_key())
+    {
+        if(!getYamlBool(tree["pregenerate-next"], config.pregenerate_next))
+        {
+            return std::unexpected("Invalid pregenerate next");
+        }
+    }
+    if(tree["thumb-pack"].has_key())
+    {
+        if(!getYamlBool(tree["thumb-pack"], config.thumb_pack))
+        {
+            return std::unexpected("Invalid thumb pack");
+        }
+    }
+    if(tree["album-sprites"].has_key())
+    {
+        if(!getYamlBool(tree["album-sprites"], config.album_sprites))
+        {
+            return std::unexpected("Invalid album sprites");
+        }
+    }
+    if(tree["sprite-page-size"].has_key())
+    {
+        if(!getYamlValue(tree["sprite-page-size"], config.sprite_page_size) ||
+           config.sprite_page_size == 0)
+        {
+            return std::unexpected("Invalid sprite page size");
+        }
+    }
+    if(tree["cache-quota-mib"].has_key())
+    {
+        if(!getYamlValue(tree["cache-quota-mib"], config.cache_quota_mib))
+        {
+            return std::unexpected("Invalid cache quota");
+        }
+    }
+    if(tree["cache-gc-interval-sec"].has_key())
+    {
+        if(!getYamlValue(tree["cache-gc-interval-sec"],
+                         config.cache_gc_interval_sec))
+        {
+            return std::unexpected("Invalid cache GC interval");
+        }
+    }
+    if(tree["access-log"].has_key())
+    {
+        auto value = tree["access-log"].val();
+        config.access_log = std::string(value.begin(), value.end());
+    }
+    if(tree["slow-request-ms"].has_key())
+    {
+        if(!getYamlValue(tree["slow-request-ms"], config.slow_request_ms))
+        {
+            return std::unexpected("Invalid slow request threshold");
+        }
+    }
+    if(tree["server-threads"].has_key())
+    {
+        if(!getYamlValue(tree["server-threads"], config.server_threads))
+        {
+            return std::unexpected("Invalid server threads");
+        }
+    }
+    if(tree["keep-alive-max-count"].has_key())
+    {
+        if(!getYamlValue(tree["keep-alive-max-count"], config.keep_alive_max_count))
+        {
+            return std::unexpected("Invalid keep-alive max count");
+        }
+    }
+    if(tree["keep-alive-timeout-sec"].has_key())
+    {
+        if(!getYamlValue(tree["keep-alive-timeout-sec"], config.keep_alive_timeout_sec))
+        {
+            return std::unexpected("Invalid keep-alive timeout");
+        }
+    }
+    if(tree["read-timeout-sec"].has_key())
+    {
+        if(!getYamlValue(tree["read-timeout-sec"], config.read_timeout_sec))
+        {
+            return std::unexpected("Invalid read timeout");
+        }
+    }
+    if(tree["write-timeout-sec"].has_key())
+    {
+        if(!getYamlValue(tree["write-timeout-sec"], config.write_timeout_sec))
+        {
+            return std::unexpected("Invalid write timeout");
+        }
+    }
+    if(tree["payload-max-bytes"].has_key())
+    {
+        if(!getYamlValue(tree["payload-max-bytes"], config.payload_max_bytes))
+        {
+            return std::unexpected("Invalid payload max length");
+        }
+    }
+    if(tree["worker-processes"].has_key())
+    {
+        if(!getYamlValue(tree["worker-processes"], config.worker_processes) ||
+           config.worker_processes == 0 ||
+           config.worker_processes > MAX_WORKER_PROCESSES)
+        {
+            return std::unexpected("Invalid worker processes");
+        }
+    }
+    if(tree["cache-snapshot"].has_key())
+    {
+        auto value = tree["cache-snapshot"].val();
+        config.cache_snapshot = std::string(value.begin(), value.end());
+    }
+    if(tree["search-index"].has_key())
+    {
+        if(!getYamlBool(tree["search-index"], config.search_index))
+        {
+            return std::unexpected("Invalid search index");
+        }
+    }
+    if(tree["search-reindex-interval-sec"].has_key())
+    {
+        if(!getYamlValue(tree["search-reindex-interval-sec"],
+                         config.search_reindex_interval_sec) ||
+           config.search_reindex_interval_sec == 0)
+        {
+            return std::unexpected("Invalid search reindex interval");
+        }
+    }
+    if(tree["watch-photos"].has_key())
+    {
+        if(!getYamlBool(tree["watch-photos"], config.watch_photos))
+        {
+            return std::unexpected("Invalid watch photos");
+        }
+    }
+    if(tree["watch-debounce-ms"].has_key())
+    {
+        if(!getYamlValue(tree["watch-debounce-ms"], config.watch_debounce_ms))
+        {
+            return std::unexpected("Invalid watch debounce");
+        }
+    }
+    if(tree["gzip-level"].has_key())
+    {
+        if(!getYamlValue(tree["gzip-level"], config.gzip_level) ||
+           config.gzip_level < 0 || config.gzip_level > 9)
+        {
+            return std::unexpected("Invalid gzip level");
+        }
+    }
+    if(tree["brotli-level"].has_key())
+    {
+        if(!getYamlValue(tree["brotli-level"], config.brotli_level) ||
+           config.brotli_level < 0 || config.brotli_level > 11)
+        {
+            return std::unexpected("Invalid brotli level");
+        }
+    }
+    if(tree["compress-min-bytes"].has_key())
+    {
+        if(!getYamlValue(tree["compress-min-bytes"], config.compress_min_bytes))
+        {
+            return std::unexpected("Invalid compress min bytes");
+        }
+    }
+    // The pack is appended to without coordination between processes.
+    if(config.worker_processes > 1 && config.thumb_pack)
+    {
+        return std::unexpected(
+            "Thumbnail pack cannot be used with multiple worker processes");
+    }
+    // Generated files of copies of a photo can only be shared in a
+    // common place.
+    if(config.content_dedup && config.cache_dir.empty())
+    {
+        return std::unexpected("Content dedup needs a cache dir");
+    }
     return std::expected<Configuration, std::string>
         {std::in_place, std::move(config)};
 }
@@ -16,8 +16,12 @@ public:
     static std::optional<Value> fromStr(std::string s);
     static std::string_view toExt(Value v);
     static std::string_view contentType(Value v);
+    // The format name used by ImageMagick.
+    static std::string_view toMagick(Value v);
 };
 
+constexpr uint32_t MAX_WORKER_PROCESSES = 256;
+
 class Configuration
 {
 public:
@@ -33,8 +37,86 @@ public:
     uint32_t present_size = 1280;
     int present_quality = 85;
     ImageFormat::Value present_format = ImageFormat::AVIF;
+    // If set, a presentation that is not generated yet is first served
+    // in this (faster to encode) format, while the one in
+    // “present_format” is generated in the background.
+    std::optional<ImageFormat::Value> present_fallback_format;
     std::string exiftool_path = "exiftool";
+    // List camera RAW files as photos. They are always shown from
+    // their embedded previews.
+    bool raw_files = false;
     uint64_t imagemagick_mem_limit_mib = 0; // Zero means unlimited.
+    // Total estimated memory of images being decoded at the same
+    // time. Images are decoded one after another if they would
+    // exceed this.
+    uint64_t decode_budget_mib = 0; // Zero means unlimited.
+    // Number of threads generating images. Zero means the number of
+    // CPUs.
+    uint32_t generation_threads = 0;
+    // If an image is not generated within this time, respond with a
+    // placeholder and keep generating it in the background.
+    uint32_t generation_deadline_ms = 0; // Zero means no deadline.
+    // Where to store generated files. If empty, they are stored in
+    // the runtime data dir next to each photo.
+    std::string cache_dir;
+    // Key generated files by the content of photos instead of their
+    // paths, so that copies of a photo share them. Needs “cache_dir”.
+    bool content_dedup = false;
+    // When the metadata of a photo is first loaded, also load the
+    // metadata of other photos in the album into memory.
+    bool metadata_preload_album = false;
+    // When a photo is viewed, generate the presentation of the next
+    // photo in the background.
+    bool pregenerate_next = false;
+    // Store thumbnails in a pack file instead of one file each.
+    bool thumb_pack = false;
+    // Show the thumbnails in album pages from sprites, each of which
+    // tiles “sprite_page_size” thumbnails.
+    bool album_sprites = false;
+    uint32_t sprite_page_size = 100;
+    // Total size of generated files to keep on disk.
+    uint64_t cache_quota_mib = 0; // Zero means unlimited.
+    // How often to garbage-collect generated files. Zero disables the
+    // garbage collection.
+    uint32_t cache_gc_interval_sec = 3600;
+    // Write an access log line for each request to this file. Empty
+    // means no access log.
+    std::string access_log;
+    // Log the time spent in each phase of requests slower than this.
+    uint32_t slow_request_ms = 0; // Zero means never.
+    // Number of threads serving requests. Zero means the default of
+    // the HTTP library.
+    uint32_t server_threads = 0;
+    uint32_t keep_alive_max_count = 5;
+    uint32_t keep_alive_timeout_sec = 5;
+    uint32_t read_timeout_sec = 5;
+    uint32_t write_timeout_sec = 5;
+    uint64_t payload_max_bytes = 0; // Zero means unlimited.
+    // Serve requests from this many processes, which share the
+    // listening port with SO_REUSEPORT.
+    uint32_t worker_processes = 1;
+    // Save the in-memory caches (album listings and metadata) to this
+    // file on shutdown, and load them on startup. Empty means no
+    // snapshot.
+    std::string cache_snapshot;
+    // Keep an index of photo names and metadata in memory for
+    // searching. The photo tree is walked in the background to build
+    // it, and again at this interval to pick up changes.
+    bool search_index = false;
+    uint32_t search_reindex_interval_sec = 3600;
+    // Watch the photo tree for new and modified photos, and generate
+    // their files in the background. A photo is only picked up after
+    // it has not changed for “watch_debounce_ms”, so that photos
+    // still being copied are not read.
+    bool watch_photos = false;
+    uint32_t watch_debounce_ms = 2000;
+    // Compression levels of pages, if the client accepts the
+    // encoding. Zero disables the encoding.
+    int gzip_level = 6; // 1 to 9
+    int brotli_level = 5; // 1 to 11
+    // Pages smaller than this are not compressed. Streamed pages are
+    // always compressed.
+    uint32_t compress_min_bytes = 1024;
 
     static E<Configuration> fromYaml(const std::filesystem::path& path);
 };
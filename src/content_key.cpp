@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include "content_key.hpp"
+#include "file_cache.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+
+// Size of each block sampled for the content key.
+constexpr size_t CONTENT_SAMPLE_SIZE = 64 * 1024;
+// Bump the version when the way keys are computed changes.
+constexpr std::string_view CONTENT_KEY_VERSION = "content:1";
+
+struct ContentKeyStamp
+{
+    uint64_t size;
+    fs::file_time_type mtime;
+};
+
+std::shared_mutex content_key_lock;
+// Content keys of photos by path.
+std::unordered_map<std::string, std::pair<ContentKeyStamp, uint64_t>> content_keys;
+
+// Hash the size of the file and the blocks at its beginning, middle,
+// and end.
+E<uint64_t> sampleHash(const fs::path& path, uint64_t size)
+{
+    std::ifstream f(path, std::ios::binary);
+    if(!f)
+    {
+        return std::unexpected(std::format("Failed to open {}",
+                                           path.string()));
+    }
+    uint64_t hash = fnv1a(std::format("{}|{}|", CONTENT_KEY_VERSION, size));
+    std::vector<char> buffer(CONTENT_SAMPLE_SIZE);
+    const std::array<uint64_t, 3> offsets = {
+        0, size / 2 - std::min<uint64_t>(size / 2, CONTENT_SAMPLE_SIZE / 2),
+        size - std::min<uint64_t>(size, CONTENT_SAMPLE_SIZE)};
+    for(uint64_t offset: offsets)
+    {
+        f.seekg(offset);
+        f.read(buffer.data(), buffer.size());
+        if(f.bad())
+        {
+            return std::unexpected(std::format("Failed to read {}",
+                                               path.string()));
+        }
+        hash = fnv1a(std::string_view(buffer.data(), f.gcount()), hash);
+        f.clear();
+    }
+    return hash;
+}
+
+E<uint64_t> fullHash(const fs::path& path)
+{
+    TRACE_SCOPE("fullHash");
+    std::ifstream f(path, std::ios::binary);
+    if(!f)
+    {
+        return std::unexpected(std::format("Failed to open {}",
+                                           path.string()));
+    }
+    uint64_t hash = fnv1a(CONTENT_KEY_VERSION);
+    std::vector<char> buffer(1024 * 1024);
+    while(f)
+    {
+        f.read(buffer.data(), buffer.size());
+        hash = fnv1a(std::string_view(buffer.data(), f.gcount()), hash);
+    }
+    if(f.bad())
+    {
+        return std::unexpected(std::format("Failed to read {}",
+                                           path.string()));
+    }
+    return hash;
+}
+
+E<void> writeContentSource(const fs::path& source_path,
+                           const nlohmann::json& source)
+{
+    std::error_code err;
+    fs::create_directories(source_path.parent_path(), err);
+    fs::path temp_path = tempPathFor(source_path);
+    {
+        std::ofstream out(temp_path);
+        out << source.dump();
+    }
+    fs::rename(temp_path, source_path, err);
+    if(err)
+    {
+        fs::remove(temp_path, err);
+        return std::unexpected(std::format("Failed to write {}",
+                                           source_path.string()));
+    }
+    return {};
+}
+
+// Work out the content key of “path”, or the error if the content
+// cannot be used as the key.
+E<uint64_t> contentKey(const fs::path& path, uint64_t size,
+                       fs::file_time_type mtime, const Configuration& config)
+{
+    TRACE_SCOPE("contentKey");
+    auto sample = sampleHash(path, size);
+    if(!sample.has_value())
+    {
+        return std::unexpected(sample.error());
+    }
+    const fs::path source_path = shardedPath(config.cache_dir, *sample,
+                                             CONTENT_SOURCE_SUFFIX);
+    nlohmann::json claimed = {{"path", path.string()},
+                              {"size", size},
+                              {"mtime", mtime.time_since_epoch().count()}};
+    auto data = readFile(source_path);
+    if(data.has_value())
+    {
+        nlohmann::json source = nlohmann::json::parse(*data, nullptr, false);
+        if(source.is_object() && source.contains("path") &&
+           source.contains("hash"))
+        {
+            // The key was claimed by this file, which has not changed
+            // since.
+            if(source["path"] == claimed["path"] &&
+               source.value("size", nlohmann::json()) == claimed["size"] &&
+               source.value("mtime", nlohmann::json()) == claimed["mtime"])
+            {
+                return *sample;
+            }
+            // Either a possible copy, or the same file after a change
+            // that the sampled blocks do not cover. The generated
+            // files were made from the content with the stored hash.
+            auto hash = fullHash(path);
+            if(!hash.has_value())
+            {
+                return std::unexpected(hash.error());
+            }
+            if(source["hash"] != std::format("{:016x}", *hash))
+            {
+                return std::unexpected(std::format(
+                    "Sampled hash of {} collides with {}", path.string(),
+                    source["path"].get<std::string>()));
+            }
+            // The content is unchanged (e.g. the file is only
+            // touched). Take over the claim, so that the full hash is
+            // not computed again next time.
+            if(source["path"] == claimed["path"])
+            {
+                claimed["hash"] = source["hash"];
+                auto status = writeContentSource(source_path, claimed);
+                if(!status.has_value())
+                {
+                    spdlog::warn("{}", status.error());
+                }
+            }
+            return *sample;
+        }
+    }
+
+    // First time the key is seen. Claim it.
+    auto hash = fullHash(path);
+    if(!hash.has_value())
+    {
+        return std::unexpected(hash.error());
+    }
+    claimed["hash"] = std::format("{:016x}", *hash);
+    auto status = writeContentSource(source_path, claimed);
+    if(!status.has_value())
+    {
+        return std::unexpected(status.error());
+    }
+    return *sample;
+}
+
+// Read the size and mtime of “source”.
+bool contentKeyStamp(const fs::path& source, ContentKeyStamp& stamp)
+{
+    std::error_code err;
+    stamp.size = fs::file_size(source, err);
+    if(err)
+    {
+        return false;
+    }
+    stamp.mtime = fs::last_write_time(source, err);
+    return !err;
+}
+
+uint64_t sourceKey(const fs::path& source, const Configuration& config)
+{
+    if(!config.content_dedup)
+    {
+        return locationKey(source);
+    }
+    ContentKeyStamp stamp;
+    if(contentKeyStamp(source, stamp))
+    {
+        std::shared_lock<std::shared_mutex> l(content_key_lock);
+        auto found = content_keys.find(source.string());
+        if(found != std::end(content_keys) &&
+           found->second.first.size == stamp.size &&
+           found->second.first.mtime == stamp.mtime)
+        {
+            return found->second.second;
+        }
+    }
+    return locationKey(source);
+}
+
+void resolveSourceKey(const fs::path& source, const Configuration& config)
+{
+    if(!config.content_dedup)
+    {
+        return;
+    }
+    ContentKeyStamp stamp;
+    if(!contentKeyStamp(source, stamp))
+    {
+        return;
+    }
+    const std::string path_str = source.string();
+    {
+        std::shared_lock<std::shared_mutex> l(content_key_lock);
+        auto found = content_keys.find(path_str);
+        if(found != std::end(content_keys) &&
+           found->second.first.size == stamp.size &&
+           found->second.first.mtime == stamp.mtime)
+        {
+            return;
+        }
+    }
+
+    uint64_t key;
+    auto content_key = contentKey(source, stamp.size, stamp.mtime, config);
+    if(content_key.has_value())
+    {
+        key = *content_key;
+    }
+    else
+    {
+        spdlog::debug("Keying {} by location: {}", path_str,
+                      content_key.error());
+        key = locationKey(source);
+    }
+    std::unique_lock<std::shared_mutex> l(content_key_lock);
+    content_keys.insert_or_assign(path_str, std::make_pair(stamp, key));
+}
+
+nlohmann::json contentKeysToJson()
+{
+    nlohmann::json result = nlohmann::json::value_t::array;
+    std::shared_lock<std::shared_mutex> l(content_key_lock);
+    for(const auto& [path, stamp_key]: content_keys)
+    {
+        result.push_back({
+            {"path", path}, {"size", stamp_key.first.size},
+            {"mtime", stamp_key.first.mtime.time_since_epoch().count()},
+            {"key", stamp_key.second}});
+    }
+    return result;
+}
+
+void loadContentKeysJson(const nlohmann::json& data)
+{
+    std::unique_lock<std::shared_mutex> l(content_key_lock);
+    for(const nlohmann::json& item: data)
+    {
+        ContentKeyStamp stamp{
+            item.at("size").get<uint64_t>(),
+            fs::file_time_type(fs::file_time_type::duration(
+                item.at("mtime").get<int64_t>()))};
+        content_keys.insert_or_assign(
+            item.at("path").get<std::string>(),
+            std::make_pair(stamp, item.at("key").get<uint64_t>()));
+    }
+}
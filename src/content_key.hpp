@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+#include <nlohmann/json.hpp>
+
+#include "config.hpp"
+
+// Suffix of the files in the cache dir that record which photo a
+// content key was first seen with.
+constexpr std::string_view CONTENT_SOURCE_SUFFIX = "-source.json";
+
+// Key of the source of generated files. Normally this is the location
+// key of the photo (see locationKey()). With “content_dedup”, it is a
+// hash of the content of the photo instead, so that copies of a photo
+// (e.g. the same photo in several albums) share the generated files
+// and metadata.
+//
+// Hashing whole photos on every request would be too slow, so the
+// content key is a hash of the size and a few sampled blocks of the
+// file. The first time a content key is seen, the full hash of the
+// file is stored next to the generated files, with the path, size and
+// mtime of the file. Another file with the same content key, or the
+// same file after it changes, is only keyed by it if its full hash
+// matches; otherwise it falls back to its location key.
+//
+// Content keys are only worked out by resolveSourceKey(), when files
+// are about to be generated from the photo, and kept in memory by
+// path, size and mtime (and in the cache snapshot). Until then,
+// sourceKey() returns the location key.
+uint64_t sourceKey(const std::filesystem::path& source,
+                   const Configuration& config);
+// Work out the content key of “source” if it is not known yet. This
+// reads the photo, so only call it when generating files.
+void resolveSourceKey(const std::filesystem::path& source,
+                      const Configuration& config);
+
+// Convert the known content keys to JSON for a snapshot, and load
+// them back. Loaded keys are validated against the size and mtime of
+// their photos when they are used, like any other.
+nlohmann::json contentKeysToJson();
+void loadContentKeysJson(const nlohmann::json& data);
@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "dir_scanner.hpp"
+
+namespace fs = std::filesystem;
+
+#ifdef __linux__
+
+// Stat’ing more entries than this is split among threads.
+constexpr size_t PARALLEL_STAT_THRESHOLD = 2048;
+constexpr unsigned int MAX_STAT_THREADS = 8;
+
+// The kernel does not export this in a header. The name is actually
+// of variable length and NUL-terminated.
+struct LinuxDirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[NAME_MAX + 1];
+};
+
+class FileDescriptor
+{
+public:
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    ~FileDescriptor()
+    {
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    int get() const { return fd; }
+
+private:
+    int fd;
+};
+
+fs::file_time_type toFileTime(const struct timespec& t)
+{
+    auto sys = std::chrono::sys_time<std::chrono::nanoseconds>(
+        std::chrono::seconds(t.tv_sec) + std::chrono::nanoseconds(t.tv_nsec));
+    return std::chrono::time_point_cast<fs::file_time_type::duration>(
+        std::chrono::file_clock::from_sys(sys));
+}
+
+// Resolve the type and mtime of the entries at “indices” with stat,
+// following symlinks.
+void statEntries(int dir_fd, std::vector<DirEntry>& entries,
+                 const std::vector<size_t>& indices, size_t begin, size_t end)
+{
+    for(size_t i = begin; i < end; i++)
+    {
+        DirEntry& entry = entries[indices[i]];
+        struct stat st;
+        if(fstatat(dir_fd, entry.name.c_str(), &st, 0) != 0)
+        {
+            entry.type = DirEntry::OTHER;
+            continue;
+        }
+        if(S_ISREG(st.st_mode))
+        {
+            entry.type = DirEntry::FILE;
+        }
+        else if(S_ISDIR(st.st_mode))
+        {
+            entry.type = DirEntry::DIRECTORY;
+        }
+        else
+        {
+            entry.type = DirEntry::OTHER;
+        }
+        entry.mtime = toFileTime(st.st_mtim);
+    }
+}
+
+std::vector<DirEntry> scanDirectory(
+    const fs::path& dir, std::function<bool(std::string_view name)> want_mtime)
+{
+    FileDescriptor fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(fd.get() < 0)
+    {
+        throw fs::filesystem_error(
+            "Failed to open directory", dir,
+            std::error_code(errno, std::generic_category()));
+    }
+
+    std::vector<DirEntry> entries;
+    // Entries that need a stat.
+    std::vector<size_t> to_stat;
+    std::vector<char> buffer(65536);
+    while(true)
+    {
+        long size = syscall(SYS_getdents64, fd.get(), buffer.data(),
+                            buffer.size());
+        if(size < 0)
+        {
+            throw fs::filesystem_error(
+                "Failed to read directory", dir,
+                std::error_code(errno, std::generic_category()));
+        }
+        if(size == 0)
+        {
+            break;
+        }
+        for(long offset = 0; offset < size;)
+        {
+            const auto* d = reinterpret_cast<const LinuxDirent64*>(
+                buffer.data() + offset);
+            offset += d->d_reclen;
+            std::string_view name(d->d_name);
+            if(name.starts_with("."))
+            {
+                continue;
+            }
+            DirEntry entry;
+            entry.name = name;
+            switch(d->d_type)
+            {
+            case DT_REG:
+                entry.type = DirEntry::FILE;
+                if(want_mtime(name))
+                {
+                    to_stat.push_back(entries.size());
+                }
+                break;
+            case DT_DIR:
+                entry.type = DirEntry::DIRECTORY;
+                break;
+            case DT_LNK:
+            case DT_UNKNOWN:
+                to_stat.push_back(entries.size());
+                break;
+            default:
+                entry.type = DirEntry::OTHER;
+                break;
+            }
+            entries.push_back(std::move(entry));
+        }
+    }
+
+    if(to_stat.size() <= PARALLEL_STAT_THRESHOLD)
+    {
+        statEntries(fd.get(), entries, to_stat, 0, to_stat.size());
+        return entries;
+    }
+
+    unsigned int thread_count = std::clamp(
+        std::thread::hardware_concurrency(), 1u, MAX_STAT_THREADS);
+    size_t chunk_size = (to_stat.size() + thread_count - 1) / thread_count;
+    std::vector<std::future<void>> jobs;
+    for(size_t begin = 0; begin < to_stat.size(); begin += chunk_size)
+    {
+        size_t end = std::min(begin + chunk_size, to_stat.size());
+        jobs.push_back(std::async(std::launch::async, statEntries, fd.get(),
+                                  std::ref(entries), std::cref(to_stat),
+                                  begin, end));
+    }
+    for(auto& job: jobs)
+    {
+        job.get();
+    }
+    return entries;
+}
+
+#else
+
+std::vector<DirEntry> scanDirectory(
+    const fs::path& dir, std::function<bool(std::string_view name)> want_mtime)
+{
+    std::vector<DirEntry> entries;
+    for(const fs::directory_entry& e: fs::directory_iterator(dir))
+    {
+        std::string name = e.path().filename().string();
+        if(name.starts_with("."))
+        {
+            continue;
+        }
+        DirEntry entry;
+        std::error_code err;
+        if(e.is_regular_file(err))
+        {
+            entry.type = DirEntry::FILE;
+            if(want_mtime(name))
+            {
+                entry.mtime = e.last_write_time(err);
+            }
+        }
+        else if(e.is_directory(err))
+        {
+            entry.type = DirEntry::DIRECTORY;
+        }
+        entry.name = std::move(name);
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct DirEntry
+{
+    enum Type { FILE, DIRECTORY, OTHER };
+
+    std::string name;
+    // Symlinks are resolved to the type of their targets. Broken
+    // symlinks are OTHER.
+    Type type = OTHER;
+    // Only set for files selected by the “want_mtime” predicate of
+    // scanDirectory().
+    std::filesystem::file_time_type mtime;
+};
+
+// List the non-hidden entries of a directory in one pass. On Linux
+// the entry types come from the d_type field of getdents64, so only
+// symlinks, entries of unknown type, and files whose modification
+// time is wanted are stat’ed. These stats are done in a batch after
+// the listing, in parallel chunks if there are many of them.
+//
+// Like std::filesystem::directory_iterator, this throws
+// std::filesystem::filesystem_error if the directory cannot be read.
+std::vector<DirEntry> scanDirectory(
+    const std::filesystem::path& dir,
+    std::function<bool(std::string_view name)> want_mtime);
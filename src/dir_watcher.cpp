@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "dir_watcher.hpp"
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+// How often the thread checks for settled changes and whether it
+// should stop.
+constexpr int WATCH_POLL_INTERVAL_MS = 100;
+
+constexpr uint32_t WATCH_MASK = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE |
+    IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR |
+    IN_EXCL_UNLINK;
+
+bool isHidden(const fs::path& path)
+{
+    return path.filename().string().starts_with('.');
+}
+
+DirWatcher::DirWatcher(const fs::path& root_dir,
+                       std::chrono::milliseconds debounce_time,
+                       Handler handler_fn)
+        : root(root_dir), debounce(debounce_time),
+          handler(std::move(handler_fn)),
+          worker([this](std::stop_token stop) { run(stop); })
+{
+}
+
+void DirWatcher::watchTree(const fs::path& dir, bool report)
+{
+    std::unordered_set<int> visited;
+    watchTree(dir, report, visited);
+}
+
+void DirWatcher::watchTree(const fs::path& dir, bool report,
+                           std::unordered_set<int>& visited)
+{
+    int wd = inotify_add_watch(fd, dir.c_str(), WATCH_MASK);
+    if(wd < 0)
+    {
+        spdlog::warn("Failed to watch {}: {}", dir.string(),
+                     std::strerror(errno));
+        return;
+    }
+    // The directory is already visited in this walk through a
+    // symlink. Stop here to avoid loops.
+    if(!visited.insert(wd).second)
+    {
+        return;
+    }
+    // A directory that is already watched keeps its watch, but is
+    // still descended into, since directories may have been created
+    // under it without being noticed (e.g. after an overflow).
+    watches.emplace(wd, dir);
+
+    std::error_code err;
+    for(const fs::directory_entry& entry: fs::directory_iterator(dir, err))
+    {
+        const fs::path& path = entry.path();
+        if(isHidden(path))
+        {
+            continue;
+        }
+        if(entry.is_directory(err))
+        {
+            watchTree(path, report, visited);
+        }
+        else if(report && entry.is_regular_file(err))
+        {
+            pending.insert_or_assign(
+                path, Pending{UPDATED, std::chrono::steady_clock::now()});
+        }
+    }
+}
+
+void DirWatcher::unwatchTree(const fs::path& dir)
+{
+    for(auto it = std::begin(watches); it != std::end(watches);)
+    {
+        auto [dir_end, _] = std::mismatch(
+            std::begin(dir), std::end(dir), std::begin(it->second),
+            std::end(it->second));
+        if(dir_end == std::end(dir))
+        {
+            inotify_rm_watch(fd, it->first);
+            it = watches.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+
+void DirWatcher::readEvents()
+{
+    alignas(inotify_event) std::array<char, 16384> buffer;
+    while(true)
+    {
+        ssize_t size = read(fd, buffer.data(), buffer.size());
+        if(size <= 0)
+        {
+            if(size < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                spdlog::warn("Failed to read file events: {}",
+                             std::strerror(errno));
+            }
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        for(ssize_t i = 0; i < size;)
+        {
+            const auto* event =
+                reinterpret_cast<const inotify_event*>(buffer.data() + i);
+            i += sizeof(inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                // Events are lost. Watch the directories created in
+                // the meantime, but the files changed in them are
+                // left for requests to pick up.
+                spdlog::warn("Too many file events, some are missed.");
+                watchTree(root, false);
+                continue;
+            }
+            if(event->mask & IN_IGNORED)
+            {
+                watches.erase(event->wd);
+                continue;
+            }
+            auto dir = watches.find(event->wd);
+            if(dir == std::end(watches) || event->len == 0)
+            {
+                continue;
+            }
+            const fs::path path = dir->second / event->name;
+            if(isHidden(path))
+            {
+                continue;
+            }
+
+            if(event->mask & IN_ISDIR)
+            {
+                if(event->mask & (IN_CREATE | IN_MOVED_TO))
+                {
+                    // Files can be copied into the directory before it
+                    // is watched, so everything in it is reported.
+                    watchTree(path, true);
+                }
+                else if(event->mask & IN_MOVED_FROM)
+                {
+                    unwatchTree(path);
+                }
+                // Deleted directories are unwatched by IN_IGNORED.
+                continue;
+            }
+            if(event->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                pending.insert_or_assign(path, Pending{REMOVED, now});
+            }
+            else
+            {
+                pending.insert_or_assign(path, Pending{UPDATED, now});
+            }
+        }
+    }
+}
+
+void DirWatcher::dispatch()
+{
+    const auto settled = std::chrono::steady_clock::now() - debounce;
+    for(auto it = std::begin(pending); it != std::end(pending);)
+    {
+        if(it->second.last_event > settled)
+        {
+            it++;
+            continue;
+        }
+        if(!handler(it->first, it->second.change))
+        {
+            // Try again in the next round.
+            return;
+        }
+        it = pending.erase(it);
+    }
+}
+
+void DirWatcher::run(std::stop_token stop)
+{
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0)
+    {
+        spdlog::error("Failed to watch photos: {}", std::strerror(errno));
+        return;
+    }
+    watchTree(root, false);
+    spdlog::info("Watching {} directories for new photos.", watches.size());
+
+    pollfd poll_fd{fd, POLLIN, 0};
+    while(!stop.stop_requested())
+    {
+        int ready = poll(&poll_fd, 1, WATCH_POLL_INTERVAL_MS);
+        if(ready > 0)
+        {
+            TRACE_SCOPE("DirWatcher::readEvents");
+            readEvents();
+        }
+        dispatch();
+    }
+    ::close(fd);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Watches a directory tree with inotify, and reports files that are
+// created, modified, or deleted in it. Hidden files and directories
+// (including the runtime data dirs) are ignored.
+//
+// A file is only reported as updated after there has been no event
+// on it for the debounce time, so that files still being written
+// (e.g. by a slow copy) are not reported half-way. When a directory
+// appears, every file in it is reported as updated.
+class DirWatcher
+{
+public:
+    enum Change { UPDATED, REMOVED };
+    // Handle a change of a file. Return false if the change cannot
+    // be handled now (e.g. the job queue is full), in which case it
+    // is handled again later.
+    using Handler = std::function<bool(const std::filesystem::path&, Change)>;
+
+    DirWatcher() = delete;
+    DirWatcher(const std::filesystem::path& root,
+               std::chrono::milliseconds debounce, Handler handler);
+    DirWatcher(const DirWatcher&) = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+private:
+    // Watch “dir” and its sub-directories. If “report” is true, also
+    // report the files in them as updated.
+    void watchTree(const std::filesystem::path& dir, bool report);
+    // Like above, skipping the directories whose watch descriptors
+    // are in “visited”, which is updated.
+    void watchTree(const std::filesystem::path& dir, bool report,
+                   std::unordered_set<int>& visited);
+    // Stop watching “dir” and its sub-directories.
+    void unwatchTree(const std::filesystem::path& dir);
+    void readEvents();
+    // Hand the settled changes to the handler.
+    void dispatch();
+    void run(std::stop_token stop);
+
+    struct Pending
+    {
+        Change change;
+        std::chrono::steady_clock::time_point last_event;
+    };
+
+    const std::filesystem::path root;
+    const std::chrono::milliseconds debounce;
+    Handler handler;
+
+    // Only used by the background thread.
+    int fd = -1;
+    std::unordered_map<int, std::filesystem::path> watches;
+    // Changes not handed to the handler yet, by path. Ordered, so
+    // that photos in an album are handled together.
+    std::map<std::filesystem::path, Pending> pending;
+
+    // This needs to be the last member, so that the thread is
+    // stopped before everything else is destroyed.
+    std::jthread worker;
+};
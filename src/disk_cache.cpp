@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <spdlog/spdlog.h>
+
+#include "content_key.hpp"
+#include "dir_scanner.hpp"
+#include "disk_cache.hpp"
+#include "image_source.hpp"
+#include "pack_store.hpp"
+#include "representation.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+
+// Pause between visiting two directories, so that the walk does not
+// compete with requests for disk IO.
+constexpr auto GC_STEP_PAUSE = std::chrono::milliseconds(10);
+// When over quota, evict until the total size is under this fraction
+// of the quota.
+constexpr double GC_LOW_WATERMARK = 0.9;
+// Temporary files older than this are left over by writers that
+// died, and are removed.
+constexpr auto TEMP_FILE_GRACE = std::chrono::hours(1);
+// With several worker processes, the access time of a served file is
+// set at most this often, to save syscalls on popular files.
+constexpr auto ACCESS_TIME_RESOLUTION = std::chrono::minutes(1);
+
+// Access time of “path”, or the minimal time if it cannot be read.
+fs::file_time_type accessTime(const fs::path& path)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0)
+    {
+        return fs::file_time_type::min();
+    }
+    auto atime = std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::seconds(st.st_atim.tv_sec) +
+            std::chrono::nanoseconds(st.st_atim.tv_nsec)));
+    return std::chrono::file_clock::from_sys(atime);
+}
+
+DiskCacheManager::DiskCacheManager(const Configuration& conf)
+        : config(conf),
+          worker([this](std::stop_token stop) { run(stop); })
+{
+}
+
+void DiskCacheManager::touch(const fs::path& path, const fs::path& source)
+{
+    std::string key = path.string();
+    const auto now = fs::file_time_type::clock::now();
+    std::lock_guard<std::mutex> l(lock);
+    auto found = entries.find(key);
+    if(found == std::end(entries))
+    {
+        std::error_code err;
+        uint64_t size = fs::file_size(path, err);
+        if(err)
+        {
+            return;
+        }
+        found = entries.emplace(std::move(key),
+                                Entry{size, now, std::nullopt, {}}).first;
+        total_size += size;
+    }
+    found->second.last_used = now;
+    if(!source.empty())
+    {
+        found->second.source = source.string();
+    }
+    if(config.worker_processes <= 1 ||
+       (found->second.last_shared.has_value() &&
+        now - *found->second.last_shared < ACCESS_TIME_RESOLUTION))
+    {
+        return;
+    }
+    found->second.last_shared = now;
+    const timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+    utimensat(AT_FDCWD, found->first.c_str(), times, 0);
+}
+
+void DiskCacheManager::removeOutputs(const fs::path& source)
+{
+    if(!config.cache_dir.empty())
+    {
+        if(config.content_dedup)
+        {
+            return;
+        }
+        // Without “content_dedup”, files in the cache dir are keyed
+        // by the location of their photos, so no other photo uses
+        // them. Their keys cannot be worked out from a deleted photo,
+        // so only the files recorded with it are found.
+        std::vector<std::string> victims;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            for(auto it = std::begin(entries); it != std::end(entries);)
+            {
+                if(it->second.source == source.string())
+                {
+                    total_size -= it->second.size;
+                    victims.push_back(it->first);
+                    it = entries.erase(it);
+                }
+                else
+                {
+                    it++;
+                }
+            }
+        }
+        for(const std::string& path: victims)
+        {
+            spdlog::debug("Removing {}...", path);
+            std::error_code err;
+            fs::remove(path, err);
+        }
+        return;
+    }
+    // Generated files are named by the stem of their sources, so they
+    // are still in use if another photo has the same stem.
+    const std::string stem = source.stem().string();
+    std::error_code err;
+    for(const fs::directory_entry& entry:
+            fs::directory_iterator(source.parent_path(), err))
+    {
+        const std::string name = entry.path().filename().string();
+        if(entry.path().stem() == stem && entry.path() != source &&
+           isImageFile(name, config.raw_files))
+        {
+            return;
+        }
+    }
+
+    const fs::path data_dir = source.parent_path() / RUNTIME_DATA_DIR;
+    const std::unordered_set<std::string> source_stems = {stem};
+    for(const fs::directory_entry& entry:
+            fs::directory_iterator(data_dir, err))
+    {
+        const fs::path& path = entry.path();
+        const std::string name = path.filename().string();
+        if(name.starts_with(SPRITE_FILE_PREFIX) ||
+           !isCurrentOutput(name, source_stems))
+        {
+            continue;
+        }
+        std::string key = path.string();
+        spdlog::debug("Removing {}...", key);
+        std::error_code remove_err;
+        fs::remove(path, remove_err);
+        std::lock_guard<std::mutex> l(lock);
+        auto found = entries.find(key);
+        if(found != std::end(entries))
+        {
+            total_size -= found->second.size;
+            entries.erase(found);
+        }
+    }
+}
+
+void DiskCacheManager::addMaintenanceTask(std::function<void()> task)
+{
+    std::lock_guard<std::mutex> l(lock);
+    maintenance_tasks.push_back(std::move(task));
+}
+
+void DiskCacheManager::run(std::stop_token stop)
+{
+    if(config.cache_gc_interval_sec == 0)
+    {
+        spdlog::info("Cache GC is disabled.");
+        return;
+    }
+    std::mutex wait_lock;
+    while(!stop.stop_requested())
+    {
+        spdlog::debug("Starting cache GC walk...");
+        orphans_removed = 0;
+        to_visit.clear();
+        visited.clear();
+        if(config.cache_dir.empty())
+        {
+            to_visit.push_back(config.photo_root_dir);
+        }
+        else
+        {
+            to_visit.push_back(config.cache_dir);
+        }
+        while(!stop.stop_requested() && step())
+        {
+            std::unique_lock<std::mutex> l(wait_lock);
+            wake.wait_for(l, stop, GC_STEP_PAUSE, [] { return false; });
+        }
+        if(stop.stop_requested())
+        {
+            break;
+        }
+        evict();
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            tasks = maintenance_tasks;
+        }
+        for(const auto& task: tasks)
+        {
+            task();
+        }
+
+        std::unique_lock<std::mutex> l(wait_lock);
+        wake.wait_for(l, stop,
+                      std::chrono::seconds(config.cache_gc_interval_sec),
+                      [] { return false; });
+    }
+}
+
+bool DiskCacheManager::step()
+{
+    if(to_visit.empty())
+    {
+        return false;
+    }
+    fs::path dir = std::move(to_visit.front());
+    to_visit.pop_front();
+    // Albums can be symlinks, which could form a loop.
+    std::error_code err;
+    fs::path real_dir = fs::canonical(dir, err);
+    if(err || !visited.insert(real_dir.string()).second)
+    {
+        return true;
+    }
+
+    std::vector<DirEntry> items;
+    try
+    {
+        items = scanDirectory(dir, [](std::string_view) { return false; });
+    }
+    catch(const fs::filesystem_error& e)
+    {
+        spdlog::warn("Cache GC failed to list {}: {}", dir.string(), e.what());
+        return true;
+    }
+
+    std::unordered_set<std::string> source_stems;
+    for(const DirEntry& item: items)
+    {
+        if(item.type == DirEntry::DIRECTORY)
+        {
+            // The packs are appended to in place and are never served
+            // as files, so they are not evictable. Their size is
+            // counted in evict().
+            if(!config.cache_dir.empty() && item.name == PACK_DIR &&
+               dir == fs::path(config.cache_dir))
+            {
+                continue;
+            }
+            to_visit.push_back(dir / item.name);
+        }
+        else if(item.type == DirEntry::FILE &&
+                isImageFile(item.name, config.raw_files))
+        {
+            source_stems.insert(fs::path(item.name).stem().string());
+        }
+    }
+
+    if(!config.cache_dir.empty())
+    {
+        // Generated files under the cache dir are keyed by the mtime
+        // of their sources and the config, so outdated ones are never
+        // served again. They are left for the quota to evict. Files
+        // being written, and the records of content keys, which are
+        // needed to tell copies of photos apart, are left alone.
+        for(const DirEntry& item: items)
+        {
+            if(item.type == DirEntry::FILE &&
+               !item.name.starts_with(TEMP_FILE_PREFIX) &&
+               !item.name.ends_with(CONTENT_SOURCE_SUFFIX))
+            {
+                registerFile(dir / item.name);
+            }
+        }
+        return true;
+    }
+
+    fs::path data_dir = dir / RUNTIME_DATA_DIR;
+    if(!fs::is_directory(data_dir, err))
+    {
+        return true;
+    }
+    for(const fs::directory_entry& entry:
+            fs::directory_iterator(data_dir, err))
+    {
+        if(!entry.is_regular_file(err))
+        {
+            continue;
+        }
+        const fs::path& path = entry.path();
+        const std::string name = path.filename().string();
+        if(name.starts_with(TEMP_FILE_PREFIX))
+        {
+            // Being written, possibly by another worker process,
+            // unless the writer died long ago.
+            std::error_code time_err;
+            auto mtime = entry.last_write_time(time_err);
+            if(time_err || fs::file_time_type::clock::now() - mtime <
+               TEMP_FILE_GRACE)
+            {
+                continue;
+            }
+        }
+        else if(isCurrentOutput(name, source_stems))
+        {
+            registerFile(path);
+            continue;
+        }
+        std::string key = path.string();
+        spdlog::debug("Removing orphan {}...", key);
+        fs::remove(path, err);
+        std::lock_guard<std::mutex> l(lock);
+        auto found = entries.find(key);
+        if(found != std::end(entries))
+        {
+            total_size -= found->second.size;
+            entries.erase(found);
+        }
+        orphans_removed++;
+    }
+    return true;
+}
+
+void DiskCacheManager::registerFile(const fs::path& path)
+{
+    std::error_code err;
+    uint64_t size = fs::file_size(path, err);
+    if(err)
+    {
+        return;
+    }
+    // Files that were not served since startup are considered used
+    // at the time they were generated.
+    auto last_used = fs::last_write_time(path, err);
+    if(config.worker_processes > 1)
+    {
+        // Files served by other workers are only known from their
+        // access times.
+        last_used = std::max(last_used, accessTime(path));
+    }
+    std::lock_guard<std::mutex> l(lock);
+    auto [found, inserted] = entries.emplace(
+        path.string(), Entry{size, last_used, std::nullopt, {}});
+    if(inserted)
+    {
+        total_size += size;
+    }
+    else if(found->second.last_used < last_used)
+    {
+        found->second.last_used = last_used;
+    }
+}
+
+uint64_t DiskCacheManager::packSize() const
+{
+    if(!config.thumb_pack)
+    {
+        return 0;
+    }
+    uint64_t size = 0;
+    std::error_code err;
+    for(const fs::directory_entry& entry:
+            fs::directory_iterator(packDir(config), err))
+    {
+        std::error_code size_err;
+        if(entry.is_regular_file(size_err))
+        {
+            size += entry.file_size(size_err);
+        }
+    }
+    return size;
+}
+
+void DiskCacheManager::evict()
+{
+    std::vector<std::string> victims;
+    {
+        std::lock_guard<std::mutex> l(lock);
+        spdlog::info("Cache GC: removed {} orphans, {} MiB in {} files.",
+                     orphans_removed, total_size / 1024 / 1024,
+                     entries.size());
+        const uint64_t quota = config.cache_quota_mib * 1024 * 1024;
+        // The packs count toward the quota, but cannot be evicted.
+        const uint64_t pinned_size = packSize();
+        if(quota == 0 || total_size + pinned_size <= quota)
+        {
+            return;
+        }
+
+        std::vector<decltype(entries)::iterator> lru;
+        lru.reserve(entries.size());
+        for(auto it = std::begin(entries); it != std::end(entries); it++)
+        {
+            lru.push_back(it);
+        }
+        std::sort(std::begin(lru), std::end(lru), [](auto a, auto b)
+        {
+            return a->second.last_used < b->second.last_used;
+        });
+
+        const auto target = static_cast<uint64_t>(quota * GC_LOW_WATERMARK);
+        for(auto it: lru)
+        {
+            if(total_size + pinned_size <= target)
+            {
+                break;
+            }
+            total_size -= it->second.size;
+            victims.push_back(it->first);
+            entries.erase(it);
+        }
+    }
+
+    // Files are removed without holding the lock, so that touch() is
+    // not blocked by disk IO.
+    for(const std::string& path: victims)
+    {
+        std::error_code err;
+        fs::remove(path, err);
+    }
+    spdlog::info("Cache GC: evicted {} files to fit in quota.",
+                 victims.size());
+}
+
+bool DiskCacheManager::isCurrentOutput(
+    const std::string& name,
+    const std::unordered_set<std::string>& source_stems) const
+{
+    if(name.starts_with(SPRITE_FILE_PREFIX))
+    {
+        // Outdated sprites are removed when they are regenerated.
+        return name.ends_with(
+            std::format(".{}", ImageFormat::toExt(config.thumb_format)));
+    }
+    auto dash = name.rfind('-');
+    if(dash == std::string::npos)
+    {
+        return false;
+    }
+    if(!source_stems.contains(name.substr(0, dash)))
+    {
+        return false;
+    }
+    std::string_view suffix = std::string_view(name).substr(dash + 1);
+    return suffix == std::format("{}.{}",
+                                 Representation::str(Representation::THUMB),
+                                 ImageFormat::toExt(config.thumb_format)) ||
+        suffix == std::format("{}.{}",
+                              Representation::str(Representation::PRESENT),
+                              ImageFormat::toExt(config.present_format)) ||
+        suffix == "metadata.json" ||
+        suffix == PLACEHOLDER_FILE_SUFFIX.substr(1);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "config.hpp"
+
+// Keeps track of the generated files, and garbage-collects them in
+// the background. A background thread walks the photo tree (or the
+// cache dir if configured) one directory at a time. In the runtime
+// data dirs of the photo tree, generated files whose source photo is
+// gone or that were generated with an old config are removed. After
+// each full walk, if the total size of generated files is over the
+// configured quota, the least recently served ones are removed.
+class DiskCacheManager
+{
+public:
+    DiskCacheManager() = delete;
+    explicit DiskCacheManager(const Configuration& conf);
+    DiskCacheManager(const DiskCacheManager&) = delete;
+    DiskCacheManager& operator=(const DiskCacheManager&) = delete;
+
+    // Record that a generated file is served, and that it is
+    // generated from photo “source” if given. With several worker
+    // processes, this is also recorded in the access time of the
+    // file, so that the worker that collects garbage sees it.
+    void touch(const std::filesystem::path& path,
+               const std::filesystem::path& source = {});
+    // Remove the generated files of “source”, which is deleted. In
+    // the cache dir, only files recorded with touch() since the start
+    // are known to be from “source”, and files there are shared with
+    // copies of the photo with “content_dedup”, in which case nothing
+    // is removed. Other files are left for the quota to evict.
+    void removeOutputs(const std::filesystem::path& source);
+    // Run “task” in the background thread after each walk.
+    void addMaintenanceTask(std::function<void()> task);
+
+private:
+    struct Entry
+    {
+        uint64_t size = 0;
+        std::filesystem::file_time_type last_used;
+        // When the access time of the file was last set by touch().
+        std::optional<std::filesystem::file_time_type> last_shared;
+        // The photo the file is generated from, if known.
+        std::string source;
+    };
+
+    void run(std::stop_token stop);
+    // Visit the next directory in the walk. Return false when the
+    // walk is finished.
+    bool step();
+    // Start tracking a generated file, if it is not tracked yet.
+    void registerFile(const std::filesystem::path& path);
+    void evict();
+    // Total size of the packs of thumbnails.
+    uint64_t packSize() const;
+    bool isCurrentOutput(
+        const std::string& name,
+        const std::unordered_set<std::string>& source_stems) const;
+
+    const Configuration& config;
+    std::unordered_map<std::string, Entry> entries;
+    uint64_t total_size = 0;
+    std::vector<std::function<void()>> maintenance_tasks;
+    std::mutex lock;
+
+    // Only used by the background thread.
+    std::deque<std::filesystem::path> to_visit;
+    std::unordered_set<std::string> visited;
+    size_t orphans_removed = 0;
+
+    std::condition_variable_any wake;
+    // This needs to be the last member, so that the thread is
+    // stopped before everything else is destroyed.
+    std::jthread worker;
+};
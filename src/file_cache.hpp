@@ -1,16 +1,88 @@
 #pragma once
 
 #include <filesystem>
+#include <format>
 #include <string_view>
+#include <system_error>
 
+#include "trace.hpp"
 #include "utils.hpp"
 
+// Key of a source file by its location. This is a hash of the path,
+// size and mtime of the file, so that a change in any of these leads
+// to a different key.
+inline uint64_t locationKey(const std::filesystem::path& source)
+{
+    std::error_code err;
+    uintmax_t size = std::filesystem::file_size(source, err);
+    if(err)
+    {
+        size = 0;
+    }
+    auto mtime = std::filesystem::last_write_time(source, err);
+    if(err)
+    {
+        mtime = {};
+    }
+    uint64_t hash = fnv1a(source.string());
+    return fnv1a(std::format("|{}|{}|", size, mtime.time_since_epoch().count()),
+                 hash);
+}
+
+// Whether the generated file “output” exists and is not older than
+// its source photo “source”. Files in the runtime data dirs are named
+// by their photos only, so this is how a photo edited in place is
+// noticed there.
+inline bool isOutputCurrent(const std::filesystem::path& output,
+                            const std::filesystem::path& source)
+{
+    std::error_code err;
+    auto output_time = std::filesystem::last_write_time(output, err);
+    if(err)
+    {
+        return false;
+    }
+    auto source_time = std::filesystem::last_write_time(source, err);
+    return err || output_time >= source_time;
+}
+
+// Key of a generated file. The key is a hash of the key of the source
+// (see sourceKey()) and a fingerprint of the config used to generate
+// it, so that a change in either leads to a different key, and the
+// file is generated again.
+inline uint64_t cacheKey(uint64_t source_key, std::string_view fingerprint)
+{
+    return fnv1a(fingerprint, source_key);
+}
+
+// Path of a generated file with key “key” under the cache root
+// “cache_dir”. Files are sharded into two levels of sub-directories
+// by the key.
+inline std::filesystem::path shardedPath(
+    const std::filesystem::path& cache_dir, uint64_t key,
+    std::string_view suffix)
+{
+    std::string hex = std::format("{:016x}", key);
+    return cache_dir / hex.substr(0, 2) / hex.substr(2, 2) /
+        std::format("{}{}", hex, suffix);
+}
+
+// Path of a generated file under the cache root “cache_dir”, keyed by
+// cacheKey().
+inline std::filesystem::path shardedCachePath(
+    const std::filesystem::path& cache_dir, uint64_t source_key,
+    std::string_view fingerprint, std::string_view suffix)
+{
+    return shardedPath(cache_dir, cacheKey(source_key, fingerprint), suffix);
+}
+
 class FileCache
 {
 public:
     virtual ~FileCache() = default;
     E<std::filesystem::path> get(const std::filesystem::path& path)
     {
+        TRACE_SCOPE("FileCache::get");
         if(isFresh(path))
         {
             return getPath(path);
@@ -1,25 +1,61 @@
 #include <algorithm>
 #include <exception>
 #include <filesystem>
+#include <format>
+#include <functional>
 #include <chrono>
 #include <mutex>
 #include <string>
 #include <string_view>
 #include <vector>
 #include <optional>
+#include <thread>
 #include <utility>
 
 #include <spdlog/spdlog.h>
 
 #include "config.hpp"
+#include "content_key.hpp"
+#include "dir_scanner.hpp"
 #include "image_source.hpp"
 #include "metadata.hpp"
+#include "request_timer.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 namespace fs = std::filesystem;
 
+// Maximal number of pending background generation tasks.
+constexpr size_t BACKGROUND_QUEUE_SIZE = 64;
+
+bool isImageFile(std::string_view name, bool include_raw)
+{
+    std::string ext = asciiLower(fs::path(name).extension().string());
+    return ext == ".jpg" || ext == ".jpeg" || ext == ".png" || ext == ".tif"
+        || ext == ".tiff" || ext == ".webp" || ext == ".avif"
+        || (include_raw && isRawFile(name));
+}
+
+// Photos are identified by their stems, so a RAW file and its JPEG
+// (e.g. “IMG_001.CR2” and “IMG_001.JPG”) share an ID. Return true if
+// “candidate” should be shown instead of “current” for that ID, so
+// that the choice does not depend on the order of the directory
+// listing: the non-RAW file wins, then the smaller name.
+bool isPreferredPhoto(const fs::path& candidate, const fs::path& current)
+{
+    bool candidate_raw = isRawFile(candidate.filename().string());
+    bool current_raw = isRawFile(current.filename().string());
+    if(candidate_raw != current_raw)
+    {
+        return current_raw;
+    }
+    return candidate.filename() < current.filename();
+}
+
 AlbumConfig AlbumConfig::fromYamlOrDefault(const fs::path& file)
 {
+    TRACE_SCOPE("AlbumConfig::fromYamlOrDefault");
     auto buffer = readFile(file);
     if(!buffer.has_value())
     {
@@ -109,48 +145,182 @@ AlbumConfig::getItemStatus(const std::string& file_base_name)
     }
 }
 
-const IDWithPath& ItemListCache::get(const std::string& key)
+std::shared_ptr<const AlbumListing> ItemListCache::get(const std::string& key)
 {
+    PhaseTimer timer(RequestTimer::LISTING);
+    TRACE_SCOPE("ItemListCache::get");
     {
         std::shared_lock<std::shared_mutex> l(lock);
         auto found = cache.find(key);
         if(found != std::end(cache) &&
-           detectStale(key, found->second) == CacheStatus::FRESH)
+           detectStale(key, *found->second) == CacheStatus::FRESH)
         {
             spdlog::debug("Cache hit on {}.", key);
             return found->second;
         }
     }
     spdlog::debug("Cache miss on {}.", key);
+    // The listing is built without the lock, since that reads the
+    // album from disk, and other listings should not wait for it.
+    // Concurrent misses of the same album may build it twice.
+    auto listing = std::make_shared<AlbumListing>(refresh(key));
     std::unique_lock<std::shared_mutex> l(lock);
-    cache[key] = refresh(key);
-    return cache[key];
+    cache.insert_or_assign(key, listing);
+    return listing;
+}
+
+std::optional<Placeholder> ItemListCache::placeholder(const std::string& key,
+                                                     const std::string& id)
+{
+    std::shared_lock<std::shared_mutex> l(lock);
+    auto listing = cache.find(key);
+    if(listing == std::end(cache))
+    {
+        return std::nullopt;
+    }
+    auto found = listing->second->placeholders.find(id);
+    if(found == std::end(listing->second->placeholders))
+    {
+        return std::nullopt;
+    }
+    return found->second;
+}
+
+void ItemListCache::setPlaceholder(const std::string& key,
+                                   const std::string& id,
+                                   const Placeholder& placeholder)
+{
+    std::unique_lock<std::shared_mutex> l(lock);
+    auto listing = cache.find(key);
+    if(listing != std::end(cache) &&
+       listing->second->photos.paths.contains(id))
+    {
+        listing->second->placeholders.insert_or_assign(id, placeholder);
+    }
 }
 
 std::vector<std::reference_wrapper<const std::string>>
 orderedIDsFromIDWithPath(const IDWithPath& map)
 {
-    std::vector<std::reference_wrapper<const std::string>> ids;
-    ids.reserve(map.paths.size());
+    return {std::begin(map.ordered_ids), std::end(map.ordered_ids)};
+}
+
+// Fill in the sorted IDs of “map”.
+void sortIDs(IDWithPath& map)
+{
+    map.ordered_ids.clear();
+    map.ordered_ids.reserve(map.paths.size());
     for(const auto& id_path: map.paths)
     {
-        ids.emplace_back(id_path.first);
+        map.ordered_ids.push_back(id_path.first);
     }
-    std::sort(std::begin(ids), std::end(ids), [](auto ref1, auto ref2)
+    std::sort(std::begin(map.ordered_ids), std::end(map.ordered_ids));
+}
+
+int64_t fileTimeToJson(fs::file_time_type t)
+{
+    return t.time_since_epoch().count();
+}
+
+fs::file_time_type fileTimeFromJson(const nlohmann::json& data)
+{
+    return fs::file_time_type(fs::file_time_type::duration(
+        data.get<fs::file_time_type::rep>()));
+}
+
+nlohmann::json pathsToJson(const IDWithPath& map)
+{
+    nlohmann::json result = nlohmann::json::value_t::object;
+    for(const auto& [id, path]: map.paths)
     {
-        return ref1.get() < ref2.get();
-    });
-    return ids;
+        result[id] = path.string();
+    }
+    return result;
+}
+
+void pathsFromJson(const nlohmann::json& data, fs::file_time_type time,
+                   IDWithPath& map)
+{
+    for(const auto& [id, path]: data.items())
+    {
+        map.paths.emplace(id, path.get<std::string>());
+    }
+    sortIDs(map);
+    map.time = time;
+}
+
+nlohmann::json ItemListCache::toJson()
+{
+    nlohmann::json result = nlohmann::json::value_t::object;
+    std::shared_lock<std::shared_mutex> l(lock);
+    for(const auto& [key, listing_ptr]: cache)
+    {
+        const AlbumListing& listing = *listing_ptr;
+        nlohmann::json item = {
+            {"time", fileTimeToJson(listing.time)},
+            {"photos", pathsToJson(listing.photos)},
+            {"albums", pathsToJson(listing.albums)},
+            {"newest", fileTimeToJson(listing.summary.newest)}};
+        if(listing.summary.cover.has_value())
+        {
+            item["cover"] = *listing.summary.cover;
+        }
+        nlohmann::json placeholders = nlohmann::json::value_t::object;
+        for(const auto& [id, placeholder]: listing.placeholders)
+        {
+            placeholders[id] = placeholder.toJson();
+        }
+        item["placeholders"] = std::move(placeholders);
+        result[key] = std::move(item);
+    }
+    return result;
+}
+
+void ItemListCache::loadJson(const nlohmann::json& data)
+{
+    std::unique_lock<std::shared_mutex> l(lock);
+    for(const auto& [key, item]: data.items())
+    {
+        AlbumListing listing;
+        listing.time = fileTimeFromJson(item.at("time"));
+        pathsFromJson(item.at("photos"), listing.time, listing.photos);
+        pathsFromJson(item.at("albums"), listing.time, listing.albums);
+        listing.summary.photo_count = listing.photos.paths.size();
+        listing.summary.newest = fileTimeFromJson(item.at("newest"));
+        if(item.contains("cover"))
+        {
+            listing.summary.cover = item["cover"].get<std::string>();
+        }
+        for(const auto& [id, data]: item.at("placeholders").items())
+        {
+            auto placeholder = Placeholder::fromJson(data);
+            if(placeholder.has_value())
+            {
+                listing.placeholders.emplace(id, *std::move(placeholder));
+            }
+        }
+        cache.insert_or_assign(
+            key, std::make_shared<AlbumListing>(std::move(listing)));
+    }
 }
 
 ImageSource::ImageSource(const Configuration& conf)
         : config(conf), dir(conf.photo_root_dir),
           thumb_manager(Representation::THUMB, conf),
           present_manager(Representation::PRESENT, conf),
-          metadata_manager(conf)
+          metadata_manager(conf), disk_cache(conf),
+          jobs(conf.generation_threads > 0 ? conf.generation_threads :
+               std::max(1u, std::thread::hardware_concurrency()),
+               BACKGROUND_QUEUE_SIZE)
 {
+    if(conf.present_fallback_format.has_value() &&
+       *conf.present_fallback_format != conf.present_format)
+    {
+        present_fallback_manager = std::make_unique<ReprManager>(
+            Representation::PRESENT, conf, conf.present_fallback_format);
+    }
     auto stale = [&]([[maybe_unused]] const std::string& id,
-                     const IDWithPath& list)
+                     const AlbumListing& list)
     {
         fs::path album_dir = dir / id;
         fs::path config_file = album_dir / ALBUM_CONFIG_FILE;
@@ -169,102 +339,158 @@ ImageSource::ImageSource(const Configuration& conf)
         return CacheStatus::FRESH;
     };
 
-    photo_list_cache.setGetFresh([&](const std::string& album_id)
+    listing_cache.setGetFresh([&](const std::string& album_id)
     {
-        IDWithPath paths;
+        AlbumListing listing;
         auto album_path = dir / album_id;
-        paths.time = std::chrono::file_clock::now();
-        for(const fs::directory_entry& entry:
-                fs::directory_iterator(album_path))
-        {
-            if(!(entry.is_regular_file() || entry.is_symlink()))
+        listing.time = std::chrono::file_clock::now();
+        listing.photos.time = listing.time;
+        listing.albums.time = listing.time;
+
+        // The status of every item in the album only depends on the
+        // config of this album and on whether this album is excluded
+        // by its ancestors, so these are only checked once here.
+        AlbumConfig album_conf = AlbumConfig::fromYamlOrDefault(
+            album_path / ALBUM_CONFIG_FILE);
+        const bool images_excluded = shouldExcludeAlbumFromParent(album_id);
+        const bool albums_excluded =
+            albumStatus(album_id) == AlbumConfig::EXCLUDE;
+
+        std::vector<DirEntry> entries = scanDirectory(
+            album_path, [&](std::string_view name)
             {
-                continue;
-            }
-            auto& path = entry.path();
-            const std::string base_name = path.filename().string();
-            if(base_name.starts_with("."))
+                return isImageFile(name, config.raw_files);
+            });
+        for(DirEntry& entry: entries)
+        {
+            if(entry.type == DirEntry::FILE &&
+               isImageFile(entry.name, config.raw_files))
             {
-                continue;
+                std::string stem = fs::path(entry.name).stem().string();
+                if(images_excluded ||
+                   album_conf.getItemStatus(stem) != AlbumConfig::SHOW)
+                {
+                    continue;
+                }
+                if(entry.mtime > listing.summary.newest)
+                {
+                    listing.summary.newest = entry.mtime;
+                }
+                auto id = (fs::path(album_id) / stem).string();
+                spdlog::debug("{} contains {}.", album_id, id);
+                fs::path photo_path = album_path / entry.name;
+                auto existing = listing.photos.paths.find(id);
+                if(existing == listing.photos.paths.end())
+                {
+                    listing.photos.paths.emplace(std::move(id),
+                                                 std::move(photo_path));
+                }
+                else if(isPreferredPhoto(photo_path, existing->second))
+                {
+                    existing->second = std::move(photo_path);
+                }
             }
-            std::string ext = asciiLower(path.extension().string());
-            if(ext == ".jpg" || ext == ".jpeg" || ext == ".png" || ext == ".tif"
-               || ext == ".tiff" || ext == ".webp" || ext == ".avif")
+            else if(entry.type == DirEntry::DIRECTORY)
             {
-                auto id = (fs::path(album_id) / fs::path(base_name).stem())
-                    .string();
-                switch(imageStatus(id))
+                if(albums_excluded ||
+                   album_conf.getItemStatus(entry.name) != AlbumConfig::SHOW)
                 {
-                case AlbumConfig::EXCLUDE:
-                case AlbumConfig::HIDE:
                     continue;
-                case AlbumConfig::SHOW:
-                    break;
                 }
-                paths.paths.emplace(id, std::move(path));
-                spdlog::debug("{} contains {}.", album_id, std::move(id));
+                listing.albums.paths.emplace(
+                    (fs::path(album_id) / entry.name).string(),
+                    album_path / entry.name);
             }
         }
-        return paths;
-    });
 
-    album_list_cache.setGetFresh([&](const std::string& album_id)
-    {
-        IDWithPath result;
-        auto album_path = dir / album_id;
-        result.time = std::chrono::file_clock::now();
-        for(const fs::directory_entry& entry:
-                fs::directory_iterator(album_path))
+        // Placeholders of the photos that were already listed are kept
+        // from the old listing, so that only new photos are read from
+        // disk.
+        for(const auto& [id, photo_path]: listing.photos.paths)
         {
-            if(!(entry.is_directory() || entry.is_symlink()))
+            auto placeholder = listing_cache.placeholder(album_id, id);
+            if(!placeholder.has_value())
             {
-                continue;
+                placeholder = thumb_manager.readPlaceholder(photo_path);
             }
-            auto& path = entry.path();
-            std::string base_name = path.filename().string();
-            std::string id = (fs::path(album_id) / base_name).string();
-            if(std::move(base_name).starts_with("."))
+            if(placeholder.has_value())
             {
-                continue;
-            }
-            switch(albumStatus(id))
-            {
-            case AlbumConfig::EXCLUDE:
-            case AlbumConfig::HIDE:
-                continue;
-            case AlbumConfig::SHOW:
-                break;
+                listing.placeholders.emplace(id, *std::move(placeholder));
             }
-
-            result.paths.emplace(std::move(id), std::move(path));
         }
-        return result;
+        sortIDs(listing.photos);
+        sortIDs(listing.albums);
+        listing.summary.photo_count = listing.photos.paths.size();
+        if(album_conf.getCover().has_value())
+        {
+            listing.summary.cover =
+                (fs::path(album_id) / (*album_conf.getCover())).string();
+        }
+        else if(!listing.photos.ordered_ids.empty())
+        {
+            listing.summary.cover = listing.photos.ordered_ids.front();
+        }
+        return listing;
     });
 
-    photo_list_cache.setDetectStale(stale);
-    album_list_cache.setDetectStale(stale);
+    listing_cache.setDetectStale(stale);
+    thumb_manager.setPlaceholderHandler(
+        [this](const fs::path& path, const Placeholder& placeholder)
+        {
+            const std::string id = photoID(path);
+            listing_cache.setPlaceholder(fs::path(id).parent_path().string(),
+                                         id, placeholder);
+        });
+    disk_cache.addMaintenanceTask([this] { thumb_manager.compactPack(); });
+    if(config.search_index)
+    {
+        indexer = std::jthread([this](std::stop_token stop)
+        {
+            runIndexer(stop);
+        });
+    }
+    if(config.watch_photos)
+    {
+        watcher = std::make_unique<DirWatcher>(
+            dir, std::chrono::milliseconds(config.watch_debounce_ms),
+            [this](const fs::path& path, DirWatcher::Change change)
+            {
+                return onPhotoChanged(path, change);
+            });
+    }
 }
 
 E<IDWithPathRef> ImageSource::images(const std::string& album)
 {
     auto album_path = dir / album;
-    AlbumConfig::ItemStatus album_status = albumStatus(album);
+    AlbumConfig::ItemStatus album_status;
+    {
+        PhaseTimer timer(RequestTimer::STATUS);
+        album_status = albumStatus(album);
+    }
     if(album_status == AlbumConfig::EXCLUDE)
     {
         return std::unexpected("Not found.");
     }
 
-    return photo_list_cache.get(album);
+    auto listing = listing_cache.get(album);
+    return IDWithPathRef(listing, &listing->photos);
 }
 
 E<IDWithPathRef> ImageSource::albums(const std::string& album)
 {
-    if(shouldExcludeAlbumFromParent(album))
+    bool excluded;
+    {
+        PhaseTimer timer(RequestTimer::STATUS);
+        excluded = shouldExcludeAlbumFromParent(album);
+    }
+    if(excluded)
     {
         return std::unexpected("Not found");
     }
 
-    return album_list_cache.get(album);
+    auto listing = listing_cache.get(album);
+    return IDWithPathRef(listing, &listing->albums);
 }
 
 std::optional<fs::path> ImageSource::image(const std::string& id)
@@ -276,20 +502,102 @@ std::optional<fs::path> ImageSource::image(const std::string& id)
     {
         return std::nullopt;
     }
-    auto found = imgs->get().paths.find(id);
-    if(found == imgs->get().paths.end())
+    auto found = (*imgs)->paths.find(id);
+    if(found == (*imgs)->paths.end())
     {
         return std::nullopt;
     }
     return found->second;
 }
 
-E<std::filesystem::path> ImageSource::getThumb(const std::string& id)
+std::function<E<void>()> generateJob(ReprManager& manager,
+                                     const fs::path& path)
+{
+    return [&manager, path]() -> E<void>
+    {
+        if(manager.isPacked())
+        {
+            auto blob = manager.getPacked(path);
+            if(!blob.has_value())
+            {
+                return std::unexpected(blob.error());
+            }
+            return {};
+        }
+        auto result = manager.get(path);
+        if(!result.has_value())
+        {
+            return std::unexpected(result.error());
+        }
+        return {};
+    };
+}
+
+std::string generateJobKey(const ReprManager& manager, const fs::path& path)
+{
+    // Copies of a photo share the output with “content_dedup”, so
+    // they share the job too.
+    return std::format("{:016x}", manager.outputKey(path));
+}
+
+E<void> ImageSource::generate(ReprManager& manager, const fs::path& path,
+                              JobQueue::Priority priority,
+                              const JobQueue::Wait& wait)
+{
+    if(manager.isCached(path))
+    {
+        return {};
+    }
+    // The job runs in another thread, so the time is counted here.
+    PhaseTimer timer(RequestTimer::GENERATE);
+    return jobs.run(generateJobKey(manager, path), priority,
+                    generateJob(manager, path), wait);
+}
+
+E<std::filesystem::path> ImageSource::getThumb(
+    const std::string& id, const JobQueue::Wait& wait)
+{
+    auto path = image(id);
+    if(path.has_value())
+    {
+        auto status = generate(thumb_manager, *path, JobQueue::THUMB,
+                               wait);
+        if(!status.has_value())
+        {
+            return std::unexpected(status.error());
+        }
+        auto thumb = thumb_manager.get(*path);
+        if(thumb.has_value())
+        {
+            disk_cache.touch(*thumb, *path);
+            ensurePlaceholder(id, *path);
+        }
+        return thumb;
+    }
+    else
+    {
+        return std::unexpected("Photo not found");
+    }
+}
+
+E<PackBlob> ImageSource::getPackedThumb(
+    const std::string& id, const JobQueue::Wait& wait)
 {
     auto path = image(id);
     if(path.has_value())
     {
-        return thumb_manager.get(*path);
+        auto status = generate(thumb_manager, *path, JobQueue::THUMB,
+                               wait);
+        if(!status.has_value())
+        {
+            return std::unexpected(status.error());
+        }
+        auto thumb = thumb_manager.getPacked(*path);
+        if(thumb.has_value())
+        {
+            ensurePlaceholder(id, *path);
+        }
+        return thumb;
     }
     else
     {
@@ -297,12 +605,24 @@ E<std::filesystem::path> ImageSource::getThumb(const std::string& id)
     }
 }
 
-E<std::filesystem::path> ImageSource::getPresent(const std::string& id)
+E<std::filesystem::path> ImageSource::getPresent(
+    const std::string& id, const JobQueue::Wait& wait)
 {
     auto path = image(id);
     if(path.has_value())
     {
-        return present_manager.get(*path);
+        auto status = generate(present_manager, *path, JobQueue::PRESENT,
+                               wait);
+        if(!status.has_value())
+        {
+            return std::unexpected(status.error());
+        }
+        auto present = present_manager.get(*path);
+        if(present.has_value())
+        {
+            disk_cache.touch(*present, *path);
+        }
+        return present;
     }
     else
     {
@@ -310,26 +630,470 @@ E<std::filesystem::path> ImageSource::getPresent(const std::string& id)
     }
 }
 
+std::optional<Placeholder> ImageSource::getPlaceholder(const std::string& id)
+{
+    return listing_cache.placeholder(fs::path(id).parent_path().string(), id);
+}
+
+void ImageSource::ensurePlaceholder(const std::string& id,
+                                    const fs::path& path)
+{
+    if(getPlaceholder(id).has_value())
+    {
+        return;
+    }
+    jobs.push(std::format("placeholder:{}", path.string()), [this, path]
+    {
+        // The result goes to the listing through the handler.
+        thumb_manager.loadPlaceholder(path);
+        return E<void>();
+    });
+}
+
+E<PresentFile> ImageSource::getPresentOrFallback(
+    const std::string& id, const JobQueue::Wait& wait)
+{
+    auto path = image(id);
+    if(!path.has_value())
+    {
+        return std::unexpected("Photo not found");
+    }
+    if(present_fallback_manager == nullptr || present_manager.isCached(*path))
+    {
+        auto present = getPresent(id, wait);
+        if(!present.has_value())
+        {
+            return std::unexpected(present.error());
+        }
+        return PresentFile{*std::move(present), config.present_format, true};
+    }
+
+    auto status = generate(*present_fallback_manager, *path,
+                           JobQueue::PRESENT, wait);
+    if(!status.has_value())
+    {
+        return std::unexpected(status.error());
+    }
+    auto fallback = present_fallback_manager->get(*path);
+    if(!fallback.has_value())
+    {
+        return std::unexpected(fallback.error());
+    }
+    disk_cache.touch(*fallback, *path);
+    // The fallback is left for the cache GC to remove, so that
+    // requests being served from it are not disturbed.
+    pregeneratePresent(id);
+    return PresentFile{*std::move(fallback),
+                       *config.present_fallback_format, false};
+}
+
+E<fs::path> ImageSource::getSprite(const std::string& album_id, size_t page,
+                                   const JobQueue::Wait& wait)
+{
+    auto imgs = images(album_id);
+    if(!imgs.has_value())
+    {
+        return std::unexpected(imgs.error());
+    }
+    const auto ids = orderedIDsFromIDWithPath(**imgs);
+    const size_t begin = page * config.sprite_page_size;
+    if(begin >= ids.size())
+    {
+        return std::unexpected("Sprite not found");
+    }
+    const size_t end = std::min(begin + config.sprite_page_size, ids.size());
+
+    // Each tile is keyed by the key of its thumbnail, which changes
+    // when the photo is edited in place, unlike the newest mtime of
+    // the album.
+    std::vector<fs::path> sources;
+    uint64_t key = fnv1a(thumb_manager.fingerprint());
+    key = fnv1a(std::format("|{}|{}|", config.sprite_page_size,
+                            SPRITE_COLUMNS), key);
+    for(size_t i = begin; i < end; i++)
+    {
+        const std::string& id = ids[i];
+        const fs::path& source = (*imgs)->paths.at(id);
+        key = fnv1a(std::format("{}|{:016x}|", id,
+                                thumb_manager.outputKey(source)), key);
+        sources.push_back(source);
+    }
+
+    const std::string_view ext = ImageFormat::toExt(config.thumb_format);
+    fs::path path;
+    if(config.cache_dir.empty())
+    {
+        path = dir / album_id / RUNTIME_DATA_DIR / std::format(
+            "{}{}-{:016x}.{}", SPRITE_FILE_PREFIX, page, key, ext);
+    }
+    else
+    {
+        path = shardedPath(config.cache_dir, key,
+                           std::format("-sprite.{}", ext));
+    }
+    if(fs::exists(path))
+    {
+        disk_cache.touch(path);
+        return path;
+    }
+
+    spdlog::debug("Generating sprite {} of {}...", page, album_id);
+    // Missing thumbnails are generated in parallel in the job queue,
+    // merged with requests of the same thumbnails.
+    std::vector<std::pair<std::string, std::function<E<void>()>>> batch;
+    for(const fs::path& source: sources)
+    {
+        if(!thumb_manager.isCached(source))
+        {
+            batch.emplace_back(generateJobKey(thumb_manager, source),
+                               generateJob(thumb_manager, source));
+        }
+    }
+    if(!batch.empty())
+    {
+        // The jobs run in other threads, so the time is counted here.
+        PhaseTimer timer(RequestTimer::GENERATE);
+        auto status = jobs.runAll(std::move(batch), JobQueue::THUMB, wait);
+        if(!status.has_value())
+        {
+            return std::unexpected(status.error());
+        }
+    }
+
+    std::vector<std::vector<char>> files;
+    std::vector<PackBlob> blobs;
+    std::vector<std::string_view> tiles;
+    for(const fs::path& source: sources)
+    {
+        // Thumbnails that failed to generate are left blank, instead
+        // of being generated again here.
+        if(!thumb_manager.isCached(source))
+        {
+            spdlog::warn("No thumbnail of {} for sprite.", source.string());
+            tiles.emplace_back();
+            continue;
+        }
+        if(thumb_manager.isPacked())
+        {
+            auto blob = thumb_manager.getPacked(source);
+            if(blob.has_value())
+            {
+                tiles.emplace_back(blob->data, blob->size);
+                blobs.push_back(*std::move(blob));
+                continue;
+            }
+        }
+        else
+        {
+            auto thumb = thumb_manager.get(source);
+            auto content = thumb.has_value() ? readFile(*thumb) :
+                E<std::vector<char>>(std::unexpected(thumb.error()));
+            if(content.has_value())
+            {
+                files.push_back(*std::move(content));
+                tiles.emplace_back(files.back().data(), files.back().size());
+                continue;
+            }
+        }
+        spdlog::warn("Failed to get thumbnail of {} for sprite.",
+                     source.string());
+        tiles.emplace_back();
+    }
+
+    std::error_code err;
+    fs::create_directories(path.parent_path(), err);
+    // makeSprite() writes to a temporary file first, so other threads
+    // generating the same sprite do not see a partial one.
+    auto status = makeSprite(tiles, config.thumb_size, config.thumb_quality,
+                             config.thumb_format, path.string());
+    if(!status.has_value())
+    {
+        return std::unexpected(status.error());
+    }
+
+    if(config.cache_dir.empty())
+    {
+        // Remove outdated sprites of the same page.
+        const std::string prefix = std::format("{}{}-", SPRITE_FILE_PREFIX,
+                                               page);
+        for(const fs::directory_entry& entry:
+                fs::directory_iterator(path.parent_path(), err))
+        {
+            std::string name = entry.path().filename().string();
+            if(name.starts_with(prefix) && entry.path() != path)
+            {
+                fs::remove(entry.path(), err);
+            }
+        }
+    }
+    disk_cache.touch(path);
+    return path;
+}
+
 E<nlohmann::json> ImageSource::getMetadata(const std::string& id)
 {
+    PhaseTimer timer(RequestTimer::METADATA);
     auto photo_path = image(id);
     if(!photo_path.has_value())
     {
         return std::unexpected("Photo not found");
     }
+    auto cached = metadata_cache.get(
+        id, *photo_path, metadata_manager.jsonPath(*photo_path));
+    if(cached.has_value())
+    {
+        return cached->toJson();
+    }
+
     auto path = metadata_manager.get(*photo_path);
     if(!path.has_value())
     {
         return std::unexpected(path.error());
     }
+    disk_cache.touch(*path, *photo_path);
+    auto metadata = metadata_cache.load(id, *photo_path, *path);
+    if(!metadata.has_value())
+    {
+        return std::unexpected(metadata.error());
+    }
+    if(config.search_index)
+    {
+        std::error_code err;
+        auto mtime = fs::last_write_time(*path, err);
+        if(!err)
+        {
+            search_index.updateMetadata(id, *metadata, mtime);
+        }
+    }
+    if(config.metadata_preload_album)
+    {
+        preloadMetadata(fs::path(id).parent_path().string());
+    }
+    return metadata->toJson();
+}
 
-    nlohmann::json data = nlohmann::json::parse(std::ifstream(*path), nullptr,
-                                                false);
-    if(data.is_discarded())
+void ImageSource::preloadMetadata(const std::string& album_id)
+{
+    auto imgs = images(album_id);
+    if(!imgs.has_value())
+    {
+        return;
+    }
+    size_t count = 0;
+    for(const auto& [id, photo_path]: (*imgs)->paths)
     {
-        return std::unexpected("Invalid JSON");
+        if(metadata_cache.contains(id))
+        {
+            continue;
+        }
+        // Only existing metadata is loaded. Metadata is not
+        // generated for photos that are not viewed.
+        if(!metadata_manager.hasMetadata(photo_path))
+        {
+            continue;
+        }
+        fs::path json_path = metadata_manager.jsonPath(photo_path);
+        if(metadata_cache.load(id, photo_path, json_path).has_value())
+        {
+            count++;
+        }
     }
-    return data;
+    spdlog::debug("Preloaded metadata of {} photos in {}.", count, album_id);
+}
+
+SearchIndex::Result ImageSource::search(std::string_view query,
+                                        size_t offset, size_t limit) const
+{
+    return search_index.search(query, offset, limit);
+}
+
+void ImageSource::indexPhotos(std::stop_token stop)
+{
+    TRACE_SCOPE("ImageSource::indexPhotos");
+    const uint64_t walk = search_index.beginWalk();
+    // Only albums and photos in the listings are visited, so hidden
+    // and excluded items are never indexed.
+    std::vector<std::string> to_visit = {""};
+    while(!to_visit.empty())
+    {
+        if(stop.stop_requested())
+        {
+            return;
+        }
+        const std::string album_id = std::move(to_visit.back());
+        to_visit.pop_back();
+        auto sub_albums = albums(album_id);
+        if(sub_albums.has_value())
+        {
+            for(const std::string& id: (*sub_albums)->ordered_ids)
+            {
+                to_visit.push_back(id);
+            }
+        }
+        auto imgs = images(album_id);
+        if(!imgs.has_value())
+        {
+            continue;
+        }
+        // The listing stays valid even if a request refreshes it
+        // while it is being indexed.
+        for(const auto& [id, photo_path]: (*imgs)->paths)
+        {
+            search_index.add(id, walk);
+            // Only existing metadata is indexed. Metadata is not
+            // generated for photos that are not viewed.
+            fs::path json_path = metadata_manager.jsonPath(photo_path);
+            std::error_code err;
+            auto mtime = fs::last_write_time(json_path, err);
+            if(err || search_index.metadataTime(id) == mtime)
+            {
+                continue;
+            }
+            auto metadata = readMetadata(json_path);
+            if(metadata.has_value())
+            {
+                search_index.updateMetadata(id, *metadata, mtime);
+            }
+        }
+    }
+    search_index.endWalk(walk);
+}
+
+void ImageSource::runIndexer(std::stop_token stop)
+{
+    std::mutex wait_lock;
+    while(!stop.stop_requested())
+    {
+        auto begin = std::chrono::steady_clock::now();
+        indexPhotos(stop);
+        if(stop.stop_requested())
+        {
+            break;
+        }
+        spdlog::info("Indexed {} photos for search in {}ms.",
+                     search_index.size(),
+                     std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - begin).count());
+        std::unique_lock<std::mutex> l(wait_lock);
+        indexer_wake.wait_for(
+            l, stop, std::chrono::seconds(config.search_reindex_interval_sec),
+            [] { return false; });
+    }
+}
+
+bool ImageSource::onPhotoChanged(const fs::path& path,
+                                 DirWatcher::Change change)
+{
+    if(!isImageFile(path.filename().string(), config.raw_files))
+    {
+        return true;
+    }
+    if(change == DirWatcher::REMOVED)
+    {
+        disk_cache.removeOutputs(path);
+        thumb_manager.erasePacked(path);
+        return true;
+    }
+
+    std::error_code err;
+    if(!fs::is_regular_file(path, err))
+    {
+        return true;
+    }
+    const std::string id = photoID(path);
+    if(imageStatus(id) == AlbumConfig::EXCLUDE)
+    {
+        return true;
+    }
+    spdlog::debug("Generating files of new or changed photo {}...", id);
+    // Jobs that are already pushed are merged, so it is fine to push
+    // all of them again if the queue is full half-way.
+    for(ReprManager* manager: {&thumb_manager, &present_manager})
+    {
+        if(manager->isCached(path))
+        {
+            continue;
+        }
+        // The files are recorded with the photo, so that they can be
+        // removed with it.
+        auto job = [this, manager, path,
+                    generate = generateJob(*manager, path)]() -> E<void>
+        {
+            auto status = generate();
+            if(!status.has_value() || manager->isPacked())
+            {
+                return status;
+            }
+            auto output = manager->get(path);
+            if(output.has_value())
+            {
+                disk_cache.touch(*output, path);
+            }
+            return status;
+        };
+        if(!jobs.push(generateJobKey(*manager, path), std::move(job)))
+        {
+            return false;
+        }
+    }
+    return jobs.push(std::format("metadata:{}", path.string()),
+                     [this, path]() -> E<void>
+                     {
+                         auto json_path = metadata_manager.get(path);
+                         if(!json_path.has_value())
+                         {
+                             return std::unexpected(json_path.error());
+                         }
+                         disk_cache.touch(*json_path, path);
+                         if(config.search_index)
+                         {
+                             indexNewPhoto(path, *json_path);
+                         }
+                         return {};
+                     });
+}
+
+void ImageSource::indexNewPhoto(const fs::path& path,
+                                const fs::path& json_path)
+{
+    // Like the walk of the indexer, only photos that are shown in
+    // albums reachable from the root are indexed.
+    const std::string id = photoID(path);
+    for(fs::path album = fs::path(id).parent_path(); !album.empty();
+        album = album.parent_path())
+    {
+        if(albumStatus(album.string()) != AlbumConfig::SHOW)
+        {
+            return;
+        }
+    }
+    if(image(id) != path)
+    {
+        return;
+    }
+    std::error_code err;
+    auto mtime = fs::last_write_time(json_path, err);
+    if(err)
+    {
+        return;
+    }
+    auto metadata = readMetadata(json_path);
+    if(!metadata.has_value())
+    {
+        return;
+    }
+    search_index.add(id);
+    search_index.updateMetadata(id, *metadata, mtime);
+}
+
+std::string ImageSource::photoID(const fs::path& path) const
+{
+    fs::path album_id = path.parent_path().lexically_relative(dir);
+    if(album_id == ".")
+    {
+        album_id.clear();
+    }
+    return (album_id / path.stem()).string();
 }
 
 AlbumConfig::ItemStatus ImageSource::imageStatus(std::string_view id) const
@@ -378,6 +1142,43 @@ AlbumConfig::ItemStatus ImageSource::albumStatus(std::string_view id) const
     }
 }
 
+Neighbours ImageSource::neighbours(const std::string& id)
+{
+    auto imgs = images(fs::path(id).parent_path().string());
+    if(!imgs.has_value())
+    {
+        return {};
+    }
+    const auto& ids = (*imgs)->ordered_ids;
+    auto found = std::lower_bound(std::begin(ids), std::end(ids), id);
+    if(found == std::end(ids) || *found != id)
+    {
+        return {};
+    }
+    Neighbours result;
+    if(found != std::begin(ids))
+    {
+        result.prev = *(found - 1);
+    }
+    if(found + 1 != std::end(ids))
+    {
+        result.next = *(found + 1);
+    }
+    return result;
+}
+
+void ImageSource::pregeneratePresent(const std::string& id)
+{
+    auto path = image(id);
+    if(!path.has_value() || present_manager.isCached(*path))
+    {
+        return;
+    }
+    spdlog::debug("Pregenerating presentation of {}...", id);
+    jobs.push(generateJobKey(present_manager, *path),
+              generateJob(present_manager, *path));
+}
+
 std::vector<IDWithName> ImageSource::navChain(std::string_view id) const
 {
     if(id.empty())
@@ -424,22 +1225,52 @@ bool ImageSource::shouldExcludeAlbumFromParent(std::string_view id) const
     }
 }
 
-std::optional<std::string>
-ImageSource::albumCover(const std::string& album_id)
+E<AlbumSummary> ImageSource::albumSummary(const std::string& album_id)
 {
-    auto album_conf = AlbumConfig::fromYamlOrDefault(
-        dir / album_id / ALBUM_CONFIG_FILE);
-    if(album_conf.getCover().has_value())
+    try
     {
-        return (fs::path(album_id) / (*album_conf.getCover())).string();
+        return listing_cache.get(album_id)->summary;
     }
-
-    auto imgs = images(album_id);
-    const auto& map = imgs->get().paths;
-    if(!imgs.has_value() || map.empty())
+    catch(const fs::filesystem_error& e)
     {
-        return std::nullopt;
+        return std::unexpected(std::format("Failed to list album {}: {}",
+                                           album_id, e.what()));
     }
+}
 
-    return std::min_element(std::begin(map), std::end(map))->first;
+E<void> ImageSource::saveSnapshot()
+{
+    nlohmann::json snapshot = {
+        {"photo_root_dir", config.photo_root_dir},
+        {"raw_files", config.raw_files},
+        {"listings", listing_cache.toJson()},
+        {"metadata", metadata_cache.toJson()},
+        {"content_keys", contentKeysToJson()}};
+    return writeSnapshot(config.cache_snapshot, snapshot);
+}
+
+E<void> ImageSource::loadSnapshot()
+{
+    auto snapshot = readSnapshot(config.cache_snapshot);
+    if(!snapshot.has_value())
+    {
+        return std::unexpected(snapshot.error());
+    }
+    // Listings depend on these, and are not validated against them.
+    if(snapshot->value("photo_root_dir", "") != config.photo_root_dir ||
+       snapshot->value("raw_files", false) != config.raw_files)
+    {
+        return std::unexpected("Snapshot is from a different config");
+    }
+    try
+    {
+        listing_cache.loadJson(snapshot->at("listings"));
+        metadata_cache.loadJson(snapshot->at("metadata"));
+        loadContentKeysJson(snapshot->at("content_keys"));
+    }
+    catch(const nlohmann::json::exception& e)
+    {
+        return std::unexpected(std::format("Invalid snapshot: {}", e.what()));
+    }
+    return {};
 }
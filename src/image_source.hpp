@@ -7,18 +7,30 @@
 #include <string_view>
 #include <optional>
 #include <filesystem>
+#include <memory>
 #include <expected>
 #include <shared_mutex>
+#include <condition_variable>
+#include <stop_token>
+#include <thread>
 
 #include <nlohmann/json.hpp>
 
 #include "config.hpp"
+#include "dir_watcher.hpp"
+#include "disk_cache.hpp"
+#include "job_queue.hpp"
 #include "metadata.hpp"
 #include "utils.hpp"
 #include "representation.hpp"
+#include "search_index.hpp"
 
 constexpr std::string_view ALBUM_CONFIG_FILE = ".nsgallery-config.yaml";
 
+// Whether a file is a photo, judging from its name. RAW files are
+// only included if “include_raw” is true.
+bool isImageFile(std::string_view name, bool include_raw = false);
+
 class AlbumConfig
 {
 public:
@@ -38,19 +50,67 @@ private:
     std::unordered_set<std::string> includes;
 };
 
+// A generated presentation file.
+struct PresentFile
+{
+    std::filesystem::path path;
+    ImageFormat::Value format;
+    // False if this is a fallback that will be replaced.
+    bool final;
+};
+
+// IDs of the photos before and after a photo in its album.
+struct Neighbours
+{
+    std::optional<std::string> prev;
+    std::optional<std::string> next;
+};
+
 struct IDWithName
 {
     std::string id;
     std::string name;
 };
 
+// A summary of an album, computed when the photo list of the album
+// is refreshed. Album pages render sub-albums from this alone.
+struct AlbumSummary
+{
+    // ID of the image used as album cover. This is nullopt if no
+    // suitable cover is found (e.g. empty album).
+    std::optional<std::string> cover;
+    // Number of photos listed in the album.
+    size_t photo_count = 0;
+    // Modification time of the newest listed photo.
+    std::filesystem::file_time_type newest;
+};
+
 struct IDWithPath
 {
     std::unordered_map<std::string, std::filesystem::path> paths;
+    // IDs in “paths”, sorted.
+    std::vector<std::string> ordered_ids;
     std::filesystem::file_time_type time;
 };
 
-using IDWithPathRef = std::reference_wrapper<const IDWithPath>;
+// Shares the ownership of the listing it is a part of, so that it
+// stays valid when the listing is refreshed.
+using IDWithPathRef = std::shared_ptr<const IDWithPath>;
+
+// Everything listed in an album directory. Photos and sub-albums are
+// listed together in one scan of the directory.
+struct AlbumListing
+{
+    IDWithPath photos;
+    IDWithPath albums;
+    AlbumSummary summary;
+    // Placeholders of the thumbnails of the photos, by ID. Photos
+    // whose thumbnails are not generated yet have none. Unlike the
+    // rest of a cached listing, these are updated in place, so they
+    // are only accessed through ItemListCache.
+    std::unordered_map<std::string, Placeholder> placeholders;
+    std::filesystem::file_time_type time;
+};
 
 std::vector<std::reference_wrapper<const std::string>>
 orderedIDsFromIDWithPath(const IDWithPath& map);
@@ -66,22 +126,40 @@ public:
     ItemListCache& operator=(const ItemListCache&) = delete;
     ItemListCache& operator=(ItemListCache&&) = default;
 
-    const IDWithPath& get(const std::string& key);
-    void setGetFresh(std::function<IDWithPath(const std::string&)> func)
+    // Listings are replaced, not changed, when they are refreshed, so
+    // the returned listing can be used without a lock.
+    std::shared_ptr<const AlbumListing> get(const std::string& key);
+    // Return the placeholder of photo “id” in the listing of album
+    // “key”. Unlike get(), this does not check whether the listing is
+    // stale, and is cheap enough to be called for every photo in a
+    // page.
+    std::optional<Placeholder> placeholder(const std::string& key,
+                                           const std::string& id);
+    // Record the placeholder of photo “id”, if the listing of album
+    // “key” is cached.
+    void setPlaceholder(const std::string& key, const std::string& id,
+                        const Placeholder& placeholder);
+    // Convert all listings to JSON for a snapshot, and load them
+    // back. Loaded listings are validated when they are got, like
+    // any other.
+    nlohmann::json toJson();
+    void loadJson(const nlohmann::json& data);
+    void setGetFresh(std::function<AlbumListing(const std::string&)> func)
     {
         refresh = func;
     }
     void setDetectStale(
-        std::function<CacheStatus(const std::string&, const IDWithPath&)> func)
+        std::function<CacheStatus(const std::string&, const AlbumListing&)>
+        func)
     {
         detectStale = func;
     }
 
 private:
-    std::unordered_map<std::string, IDWithPath> cache;
+    std::unordered_map<std::string, std::shared_ptr<AlbumListing>> cache;
     std::shared_mutex lock;
-    std::function<IDWithPath(const std::string&)> refresh;
-    std::function<CacheStatus(const std::string&, const IDWithPath&)>
+    std::function<AlbumListing(const std::string&)> refresh;
+    std::function<CacheStatus(const std::string&, const AlbumListing&)>
     detectStale;
 };
 
@@ -99,33 +177,112 @@ public:
     // Find an image by ID.
     std::optional<std::filesystem::path> image(const std::string& id);
 
-    E<std::filesystem::path> getThumb(const std::string& id);
-    E<std::filesystem::path> getPresent(const std::string& id);
+    // The get*() functions generate the image in the job queue if
+    // needed, and wait for it as told by “wait”.
+    E<std::filesystem::path> getThumb(
+        const std::string& id, const JobQueue::Wait& wait = {});
+    // Only available if thumbnails are packed.
+    E<PackBlob> getPackedThumb(
+        const std::string& id, const JobQueue::Wait& wait = {});
+    E<std::filesystem::path> getPresent(
+        const std::string& id, const JobQueue::Wait& wait = {});
+    // Return the placeholder of the thumbnail, if the thumbnail is
+    // generated. This only reads the cached listing, so “id” should
+    // come from a listing returned by images().
+    std::optional<Placeholder> getPlaceholder(const std::string& id);
+    // Like getPresent(), but if the presentation is not generated yet
+    // and there is a fallback format in the config, return one in
+    // the fallback format, and generate the real one in the
+    // background.
+    E<PresentFile> getPresentOrFallback(
+        const std::string& id, const JobQueue::Wait& wait = {});
+    // Return the sprite of page “page” of the thumbnails in the
+    // album. It is regenerated if photos in the page change. Missing
+    // thumbnails are generated in the job queue, waited for as told
+    // by “wait”.
+    E<std::filesystem::path> getSprite(const std::string& album_id,
+                                       size_t page,
+                                       const JobQueue::Wait& wait = {});
     E<nlohmann::json> getMetadata(const std::string& id);
 
     AlbumConfig::ItemStatus imageStatus(std::string_view id) const;
     AlbumConfig::ItemStatus albumStatus(std::string_view id) const;
 
-    // Return the ID of the image that is used as album cover. It is
-    // possible to not find a suitable cover (e.g. empty album). In
-    // that case returns nullopt.
-    std::optional<std::string> albumCover(const std::string& album_id);
+    // Return the summary of an album. This does not check the
+    // access status of the album, so “album_id” should come from a
+    // listing returned by albums().
+    E<AlbumSummary> albumSummary(const std::string& album_id);
+
+    // Return the photos before and after photo “id” in its album.
+    Neighbours neighbours(const std::string& id);
+    // Generate the presentation of a photo in the background.
+    void pregeneratePresent(const std::string& id);
 
     // Return a link of ancesters of the item with “id”, from the
     // album directly under root to the directly containing album.
     std::vector<IDWithName> navChain(std::string_view id) const;
 
+    // Search photos by name and metadata. Only available if the
+    // search index is enabled in the config.
+    SearchIndex::Result search(std::string_view query, size_t offset,
+                               size_t limit) const;
+
+    // Save the in-memory caches to the snapshot file in the config,
+    // and load them from it.
+    E<void> saveSnapshot();
+    E<void> loadSnapshot();
+
 private:
+    // Generate the representation of “path” in the job queue if it is
+    // not generated yet, and wait for it.
+    E<void> generate(ReprManager& manager, const std::filesystem::path& path,
+                     JobQueue::Priority priority,
+                     const JobQueue::Wait& wait);
     bool shouldExcludeImageFromParent(std::string_view id) const;
+    // Load the existing metadata of all photos in an album into the
+    // metadata cache.
+    void preloadMetadata(const std::string& album_id);
     bool shouldExcludeAlbumFromParent(std::string_view id) const;
+    // Walk the listed albums and add their photos to the search
+    // index, with their existing metadata.
+    void indexPhotos(std::stop_token stop);
+    // Add photo “path” found by the file watcher to the search index,
+    // with its metadata in “json_path”, without waiting for the next
+    // walk.
+    void indexNewPhoto(const std::filesystem::path& path,
+                       const std::filesystem::path& json_path);
+    void runIndexer(std::stop_token stop);
+    // Generate the thumbnail, presentation, and metadata of a photo
+    // that is added or modified in the background, or remove those
+    // of a photo that is deleted. Return false if the job queue is
+    // full.
+    bool onPhotoChanged(const std::filesystem::path& path,
+                        DirWatcher::Change change);
+    // ID of the photo at “path”, which is under the photo root.
+    std::string photoID(const std::filesystem::path& path) const;
+    // Load the placeholder of a photo into its listing in the
+    // background, if it is not there yet.
+    void ensurePlaceholder(const std::string& id,
+                           const std::filesystem::path& path);
 
     const Configuration& config;
     const std::filesystem::path dir;
 
-    ItemListCache photo_list_cache;
-    ItemListCache album_list_cache;
+    ItemListCache listing_cache;
 
     ReprManager thumb_manager;
     ReprManager present_manager;
+    // Only exists if there is a fallback format for presentations.
+    std::unique_ptr<ReprManager> present_fallback_manager;
     MetadataManager metadata_manager;
+    MetadataCache metadata_cache;
+    DiskCacheManager disk_cache;
+    SearchIndex search_index;
+    JobQueue jobs;
+    std::condition_variable_any indexer_wake;
+    // These need to be the last members, so that the threads are
+    // stopped before everything else is destroyed. The watcher only
+    // exists if enabled in the config.
+    std::unique_ptr<DirWatcher> watcher;
+    std::jthread indexer;
 };
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "job_queue.hpp"
+
+// How often waiters check whether they are cancelled.
+constexpr auto JOB_POLL_INTERVAL = std::chrono::milliseconds(100);
+
+JobQueue::JobQueue(size_t thread_count, size_t max_pending)
+        : max_pending(max_pending)
+{
+    for(size_t i = 0; i < thread_count; i++)
+    {
+        workers.emplace_back([this](std::stop_token stop) { work(stop); });
+    }
+}
+
+E<void> JobQueue::run(const std::string& key, Priority priority,
+                      std::function<E<void>()> job_fn, const Wait& wait)
+{
+    std::unique_lock<std::mutex> l(lock);
+    std::shared_ptr<Job> job = submit(key, priority, std::move(job_fn));
+    job->waiters++;
+    auto status = waitFor(l, {job}, wait);
+    if(!status.has_value())
+    {
+        return status;
+    }
+    job->waiters--;
+    return job->result;
+}
+
+E<void> JobQueue::runAll(
+    std::vector<std::pair<std::string, std::function<E<void>()>>> batch,
+    Priority priority, const Wait& wait)
+{
+    std::unique_lock<std::mutex> l(lock);
+    std::vector<std::shared_ptr<Job>> submitted;
+    submitted.reserve(batch.size());
+    for(auto& [key, job_fn]: batch)
+    {
+        submitted.push_back(submit(key, priority, std::move(job_fn)));
+        submitted.back()->waiters++;
+    }
+    auto status = waitFor(l, submitted, wait);
+    if(!status.has_value())
+    {
+        return status;
+    }
+    for(const std::shared_ptr<Job>& job: submitted)
+    {
+        job->waiters--;
+    }
+    return {};
+}
+
+E<void> JobQueue::waitFor(std::unique_lock<std::mutex>& l,
+                          const std::vector<std::shared_ptr<Job>>& waited,
+                          const Wait& wait)
+{
+    auto all_done = [&]
+    {
+        return std::all_of(std::begin(waited), std::end(waited),
+                           [](const auto& job) { return job->done; });
+    };
+    while(!all_done())
+    {
+        Clock::time_point until = Clock::now() + JOB_POLL_INTERVAL;
+        if(wait.deadline.has_value())
+        {
+            until = std::min(until, *wait.deadline);
+        }
+        finished.wait_until(l, until);
+        if(all_done())
+        {
+            break;
+        }
+        if(wait.deadline.has_value() && Clock::now() >= *wait.deadline)
+        {
+            for(const std::shared_ptr<Job>& job: waited)
+            {
+                // Whoever asks next should find the result.
+                job->waiters--;
+                if(!job->done)
+                {
+                    job->background = true;
+                }
+            }
+            return std::unexpected(std::string(JOB_TIMED_OUT));
+        }
+        if(!wait.cancelled)
+        {
+            continue;
+        }
+        l.unlock();
+        const bool stop_waiting = wait.cancelled();
+        l.lock();
+        if(stop_waiting && !all_done())
+        {
+            for(const std::shared_ptr<Job>& job: waited)
+            {
+                job->waiters--;
+                if(job->waiters == 0 && !job->started && !job->background &&
+                   !job->done)
+                {
+                    spdlog::debug("Dropping job {}, since nobody waits for "
+                                  "it.", job->key);
+                    pending.erase(Order(job->priority, job->seq));
+                    jobs.erase(job->key);
+                }
+            }
+            return std::unexpected("Cancelled");
+        }
+    }
+    return {};
+}
+
+bool JobQueue::push(const std::string& key, std::function<E<void>()> job_fn)
+{
+    std::lock_guard<std::mutex> l(lock);
+    auto found = jobs.find(key);
+    if(found != std::end(jobs))
+    {
+        found->second->background = true;
+        return true;
+    }
+    if(pending.size() >= max_pending)
+    {
+        spdlog::debug("Job queue is full, dropping job {}.", key);
+        return false;
+    }
+    submit(key, BACKGROUND, std::move(job_fn))->background = true;
+    return true;
+}
+
+std::shared_ptr<JobQueue::Job> JobQueue::submit(
+    const std::string& key, Priority priority, std::function<E<void>()>&& fn)
+{
+    auto found = jobs.find(key);
+    if(found != std::end(jobs))
+    {
+        std::shared_ptr<Job> job = found->second;
+        if(!job->started && priority < job->priority)
+        {
+            pending.erase(Order(job->priority, job->seq));
+            job->priority = priority;
+            pending.emplace(Order(job->priority, job->seq), job);
+        }
+        return job;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->key = key;
+    job->fn = std::move(fn);
+    job->priority = priority;
+    job->seq = next_seq++;
+    pending.emplace(Order(job->priority, job->seq), job);
+    jobs.emplace(key, job);
+    wake.notify_one();
+    return job;
+}
+
+void JobQueue::work(std::stop_token stop)
+{
+    while(true)
+    {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if(!wake.wait(l, stop, [this] { return !pending.empty(); }))
+            {
+                return;
+            }
+            auto first = std::begin(pending);
+            job = std::move(first->second);
+            pending.erase(first);
+            job->started = true;
+        }
+        E<void> result;
+        try
+        {
+            result = job->fn();
+        }
+        catch(const std::exception& e)
+        {
+            result = std::unexpected(e.what());
+        }
+        bool unwatched;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            unwatched = job->waiters == 0;
+            job->result = result;
+            job->done = true;
+            jobs.erase(job->key);
+        }
+        finished.notify_all();
+        if(unwatched && !result.has_value())
+        {
+            spdlog::warn("Job {} failed: {}", job->key, result.error());
+        }
+    }
+}
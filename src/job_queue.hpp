@@ -0,0 +1,109 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+// The error of JobQueue::run() when the deadline has passed.
+constexpr std::string_view JOB_TIMED_OUT = "Timed out";
+
+// Runs jobs in worker threads, highest priority first, and in the
+// order they are submitted within a priority. Jobs are identified by
+// keys: a job submitted while another with the same key is pending
+// or running is merged into it. A job that nobody waits for anymore
+// is dropped before it starts, unless it was pushed as a background
+// job.
+class JobQueue
+{
+public:
+    // Lower values run first.
+    enum Priority { THUMB, PRESENT, BACKGROUND };
+    using Clock = std::chrono::steady_clock;
+
+    // How long a caller of run() waits for its job.
+    struct Wait
+    {
+        // Polled while waiting. If it returns true, stop waiting, and
+        // drop the job if nobody else waits for it.
+        std::function<bool()> cancelled;
+        // Stop waiting at this time, but keep the job going.
+        std::optional<Clock::time_point> deadline;
+    };
+
+    JobQueue() = delete;
+    // If more than “max_pending” jobs are waiting, new background
+    // jobs are dropped.
+    JobQueue(size_t thread_count, size_t max_pending);
+    JobQueue(const JobQueue&) = delete;
+    JobQueue& operator=(const JobQueue&) = delete;
+
+    // Run the job and wait for it to finish. If the wait is cut short,
+    // return an error, which is JOB_TIMED_OUT if the deadline has
+    // passed.
+    E<void> run(const std::string& key, Priority priority,
+                std::function<E<void>()> job, const Wait& wait);
+    // Like run(), but run all of “batch” (pairs of keys and jobs) in
+    // parallel, and wait for all of them. Errors of the jobs are not
+    // returned, only those of the wait.
+    E<void> runAll(
+        std::vector<std::pair<std::string, std::function<E<void>()>>> batch,
+        Priority priority, const Wait& wait);
+    // Run the job without waiting for it. Return false if the job is
+    // dropped.
+    bool push(const std::string& key, std::function<E<void>()> job);
+
+private:
+    struct Job
+    {
+        std::string key;
+        std::function<E<void>()> fn;
+        Priority priority;
+        uint64_t seq;
+        size_t waiters = 0;
+        bool background = false;
+        bool started = false;
+        bool done = false;
+        E<void> result;
+    };
+    using Order = std::pair<Priority, uint64_t>;
+
+    // Return the job with “key”, creating and queuing it if needed.
+    // Must be called with “lock” held.
+    std::shared_ptr<Job> submit(const std::string& key, Priority priority,
+                                std::function<E<void>()>&& fn);
+    // Wait for “waited” to finish as told by “wait”. If the wait is
+    // cut short, stop waiting for the jobs that are not done, and
+    // return the error of run(). Must be called with “l” locking
+    // “lock”.
+    E<void> waitFor(std::unique_lock<std::mutex>& l,
+                    const std::vector<std::shared_ptr<Job>>& waited,
+                    const Wait& wait);
+    void work(std::stop_token stop);
+
+    const size_t max_pending;
+    uint64_t next_seq = 0;
+    // Jobs that are not started yet, in the order to run them.
+    std::map<Order, std::shared_ptr<Job>> pending;
+    // Pending and running jobs.
+    std::unordered_map<std::string, std::shared_ptr<Job>> jobs;
+    std::mutex lock;
+    std::condition_variable_any wake;
+    std::condition_variable finished;
+    // This needs to be the last member, so that the threads are
+    // stopped before everything else is destroyed.
+    std::vector<std::jthread> workers;
+};
@@ -1,9 +1,117 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
 #include <spdlog/spdlog.h>
 #include <Magick++.h>
 #include <cxxopts.hpp>
 
 #include "app.hpp"
 #include "config.hpp"
+#include "representation.hpp"
+
+// PIDs of the worker processes in prefork mode. This is a plain
+// array so that the signal handler can use it.
+pid_t worker_pids[MAX_WORKER_PROCESSES] = {};
+volatile std::sig_atomic_t stopping_workers = 0;
+
+void stopWorkers(int signal)
+{
+    stopping_workers = 1;
+    for(pid_t pid: worker_pids)
+    {
+        if(pid > 0)
+        {
+            kill(pid, signal);
+        }
+    }
+}
+
+// Fork worker process “index”. Return true in the worker.
+bool forkWorker(uint32_t index)
+{
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        spdlog::error("Failed to fork worker {}: {}", index,
+                      std::strerror(errno));
+        return false;
+    }
+    if(pid == 0)
+    {
+        std::signal(SIGTERM, SIG_DFL);
+        std::signal(SIGINT, SIG_DFL);
+#ifdef __linux__
+        // Do not outlive the parent.
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        return true;
+    }
+    worker_pids[index] = pid;
+    return false;
+}
+
+// Run “count” worker processes, and restart those that exit, until
+// the parent is told to stop. In the workers, return the index of the
+// worker. In the parent, return std::nullopt after all workers exit.
+std::optional<uint32_t> superviseWorkers(uint32_t count)
+{
+    std::signal(SIGTERM, stopWorkers);
+    std::signal(SIGINT, stopWorkers);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        if(forkWorker(i))
+        {
+            return i;
+        }
+    }
+    spdlog::info("Started {} worker processes.", count);
+
+    while(true)
+    {
+        int status = 0;
+        pid_t pid = wait(&status);
+        if(pid < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return std::nullopt;
+        }
+        for(uint32_t i = 0; i < count; i++)
+        {
+            if(worker_pids[i] != pid)
+            {
+                continue;
+            }
+            worker_pids[i] = 0;
+            if(stopping_workers)
+            {
+                break;
+            }
+            spdlog::warn("Worker {} exited with status {}, restarting...", i,
+                         status);
+            // Do not restart too fast if the worker cannot start.
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            if(forkWorker(i))
+            {
+                return i;
+            }
+        }
+    }
+}
 
 int main([[maybe_unused]] int argc, char** argv)
 {
@@ -28,14 +136,48 @@ int main([[maybe_unused]] int argc, char** argv)
         return 1;
     }
 
+    Configuration worker_config = *config;
+    if(config->worker_processes > 1)
+    {
+        // Fork before anything else is initialized, so that each
+        // worker has its own threads and ImageMagick state.
+        auto index = superviseWorkers(config->worker_processes);
+        if(!index.has_value())
+        {
+            return 0;
+        }
+        // The workers share the generated files, which only need to
+        // be garbage-collected and generated for new photos by one of
+        // them.
+        if(*index > 0)
+        {
+            worker_config.cache_gc_interval_sec = 0;
+            worker_config.watch_photos = false;
+        }
+        // The memory limits are for the whole server, and are split
+        // among the workers.
+        for(uint64_t* limit: {&worker_config.imagemagick_mem_limit_mib,
+                              &worker_config.decode_budget_mib})
+        {
+            if(*limit > 0)
+            {
+                *limit = std::max<uint64_t>(
+                    1, *limit / config->worker_processes);
+            }
+        }
+    }
+
     Magick::InitializeMagick(*argv);
-    if(config->imagemagick_mem_limit_mib > 0)
+    if(worker_config.imagemagick_mem_limit_mib > 0)
     {
-        Magick::ResourceLimits::memory(config->imagemagick_mem_limit_mib);
+        // The limit is in bytes.
+        Magick::ResourceLimits::memory(
+            worker_config.imagemagick_mem_limit_mib << 20);
     }
+    setDecodeBudget(worker_config.decode_budget_mib << 20);
     // spdlog::set_level(spdlog::level::debug);
 
-    App app(*config);
+    App app(worker_config);
     app.start();
 
     return 0;
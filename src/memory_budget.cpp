@@ -0,0 +1,34 @@
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+
+#include "memory_budget.hpp"
+
+MemoryBudget::Grant MemoryBudget::acquire(uint64_t bytes)
+{
+    bytes = std::min(bytes, limit);
+    std::unique_lock<std::mutex> l(lock);
+    // Jobs are granted in the order they arrive, so that a large job
+    // waiting for memory is not starved by small ones that would
+    // still fit.
+    const uint64_t ticket = next_ticket++;
+    released.wait(l, [&]
+    {
+        return ticket == now_serving && used + bytes <= limit;
+    });
+    used += bytes;
+    now_serving++;
+    l.unlock();
+    // The next job in line may fit as well.
+    released.notify_all();
+    return Grant(this, bytes);
+}
+
+void MemoryBudget::release(uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> l(lock);
+        used -= bytes;
+    }
+    released.notify_all();
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// A budget of memory shared by concurrent jobs. A job acquires its
+// estimated memory before it starts, and waits if that would exceed
+// the budget. A job larger than the whole budget waits until no
+// other job is running, so that it runs alone. Jobs get their memory
+// in the order they ask for it.
+class MemoryBudget
+{
+public:
+    // Releases the memory when destroyed.
+    class Grant
+    {
+    public:
+        Grant() = delete;
+        Grant(MemoryBudget* budget, uint64_t bytes)
+                : budget(budget), bytes(bytes) {}
+        Grant(const Grant&) = delete;
+        Grant& operator=(const Grant&) = delete;
+        Grant(Grant&& other) noexcept
+                : budget(other.budget), bytes(other.bytes)
+        {
+            other.budget = nullptr;
+        }
+        ~Grant()
+        {
+            if(budget != nullptr)
+            {
+                budget->release(bytes);
+            }
+        }
+
+    private:
+        MemoryBudget* budget;
+        uint64_t bytes;
+    };
+
+    MemoryBudget() = delete;
+    explicit MemoryBudget(uint64_t limit) : limit(limit) {}
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    Grant acquire(uint64_t bytes);
+    uint64_t capacity() const { return limit; }
+
+private:
+    void release(uint64_t bytes);
+
+    const uint64_t limit;
+    uint64_t used = 0;
+    // The ticket of the next job to ask, and of the job that is
+    // granted next.
+    uint64_t next_ticket = 0;
+    uint64_t now_serving = 0;
+    std::mutex lock;
+    std::condition_variable released;
+};
@@ -1,48 +1,95 @@
+#include <cerrno>
+#include <cstring>
 #include <string>
 #include <expected>
 #include <fstream>
+#include <vector>
 
-#include <stdio.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 
+#include "content_key.hpp"
 #include "metadata.hpp"
+#include "request_timer.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 namespace fs = std::filesystem;
 
-E<std::vector<char>> runOutput(const std::string& command)
+extern char** environ;
+
+E<std::vector<char>> runOutput(const std::vector<std::string>& args)
 {
-    // 64KiB block.
-    size_t block_size = 65536;
-    std::vector<char> output(block_size, 0);
-    FILE* proc = popen(command.c_str(), "r");
-    if(proc == nullptr)
+    PhaseTimer timer(RequestTimer::GENERATE);
+    TRACE_SCOPE("runOutput");
+    int pipe_fds[2];
+    if(pipe2(pipe_fds, O_CLOEXEC) != 0)
+    {
+        return std::unexpected("Failed to create pipe");
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    std::vector<char*> argv;
+    for(const std::string& arg: args)
+    {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(),
+                           environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fds[1]);
+    if(err != 0)
     {
-        return std::unexpected("Failed to run command");
+        close(pipe_fds[0]);
+        return std::unexpected(std::format("Failed to run {}: {}", args[0],
+                                           std::strerror(err)));
     }
+
+    // 64KiB block.
+    size_t block_size = 65536;
+    std::vector<char> output;
     size_t cursor = 0;
-    while(!feof(proc))
+    bool read_failed = false;
+    while(true)
     {
-        if(output.size() - cursor < block_size)
+        output.resize(cursor + block_size);
+        ssize_t size = read(pipe_fds[0], &output[cursor], block_size);
+        if(size < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(size < 0)
         {
-            output.resize(cursor + block_size);
+            read_failed = true;
         }
-        cursor += fread(&output[cursor], 1, block_size, proc);
-        if(ferror(proc))
+        if(size <= 0)
         {
-            return std::unexpected("Failed to read command output");
+            break;
         }
+        cursor += size;
     }
-
+    close(pipe_fds[0]);
     output.resize(cursor);
-    if(pclose(proc) != 0)
+
+    int status = 0;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if(read_failed)
+    {
+        return std::unexpected("Failed to read command output");
+    }
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
     {
         return std::unexpected("Command failed");
     }
-
-    return {output};
+    return output;
 }
 
 void transferValue(nlohmann::json& src, nlohmann::json& dest, const char* field,
@@ -60,6 +107,64 @@ void transferValue(nlohmann::json& src, nlohmann::json& dest, const char* field,
     }
 }
 
+// Get a field as text, whether it is a string or a number.
+std::string fieldText(const nlohmann::json& data, const char* field)
+{
+    auto found = data.find(field);
+    if(found == data.end() || found->is_null())
+    {
+        return {};
+    }
+    if(found->is_string())
+    {
+        return found->get<std::string>();
+    }
+    return found->dump();
+}
+
+PhotoMetadata PhotoMetadata::fromJson(const nlohmann::json& data)
+{
+    PhotoMetadata m;
+    if(!data.is_object())
+    {
+        return m;
+    }
+    m.make = fieldText(data, "Make");
+    m.model = fieldText(data, "Model");
+    m.f_number = fieldText(data, "FNumber");
+    m.exposure_time = fieldText(data, "ExposureTime");
+    m.iso = fieldText(data, "ISO");
+    m.focal_length = fieldText(data, "FocalLength");
+    m.lens = fieldText(data, "LensID");
+    m.headline = fieldText(data, "Headline");
+    m.title = fieldText(data, "Title");
+    m.caption = fieldText(data, "Caption-Abstract");
+    return m;
+}
+
+nlohmann::json PhotoMetadata::toJson() const
+{
+    nlohmann::json data = nlohmann::json::value_t::object;
+    auto set = [&](const char* field, const std::string& value)
+    {
+        if(!value.empty())
+        {
+            data[field] = value;
+        }
+    };
+    set("Make", make);
+    set("Model", model);
+    set("FNumber", f_number);
+    set("ExposureTime", exposure_time);
+    set("ISO", iso);
+    set("FocalLength", focal_length);
+    set("LensID", lens);
+    set("Headline", headline);
+    set("Title", title);
+    set("Caption-Abstract", caption);
+    return data;
+}
+
 MetadataManager::MetadataManager(const Configuration& conf)
         : config(conf)
 {
@@ -67,22 +172,39 @@ MetadataManager::MetadataManager(const Configuration& conf)
 
 fs::path MetadataManager::getPath(const fs::path& path)
 {
+    if(!config.cache_dir.empty())
+    {
+        // Bump the version here when the set of extracted fields
+        // changes.
+        return shardedCachePath(config.cache_dir, sourceKey(path, config),
+                                "metadata:1", "-metadata.json");
+    }
     std::string basename = path.stem().string();
     return path.parent_path() / RUNTIME_DATA_DIR / (basename + "-metadata.json");
 }
 
 bool MetadataManager::isFresh(const fs::path& path)
 {
-    return fs::exists(getPath(path));
+    if(!config.cache_dir.empty())
+    {
+        // The path changes with the photo.
+        return fs::exists(getPath(path));
+    }
+    return isOutputCurrent(getPath(path), path);
 }
 
 E<void> MetadataManager::refresh(const fs::path& path)
 {
-    std::string cmd = std::format(
-        "\"{}\" -json -Make -Model -FNumber -ExposureTime -ISO -LensID "
-        "-FocalLength -Headline -Title -Caption-Abstract \"{}\"",
-        config.exiftool_path, path.string());
-    auto output = runOutput(cmd.c_str());
+    // A copy of the photo may have it extracted already.
+    resolveSourceKey(path, config);
+    if(isFresh(path))
+    {
+        return {};
+    }
+    auto output = runOutput({
+        config.exiftool_path, "-json", "-Make", "-Model", "-FNumber",
+        "-ExposureTime", "-ISO", "-LensID", "-FocalLength", "-Headline",
+        "-Title", "-Caption-Abstract", path.string()});
     if(!output.has_value())
     {
         return std::unexpected(output.error());
@@ -111,17 +233,145 @@ E<void> MetadataManager::refresh(const fs::path& path)
     transferValue(data[0], normalized, "Caption-Abstract",
                   nlohmann::json::value_t::string);
     spdlog::debug("Normalized metadata is {}", normalized.dump());
-    std::ofstream file(getPath(path));
+    fs::path json_path = getPath(path);
+    std::error_code err;
+    fs::create_directories(json_path.parent_path(), err);
+    fs::path temp_path = tempPathFor(json_path);
+    std::ofstream file(temp_path);
     if(!file)
     {
         return std::unexpected("Failed to open metadata JSON file");
     }
 
     file << normalized;
+    file.close();
     if(!file)
     {
+        fs::remove(temp_path, err);
+        return std::unexpected("Failed to write metadata JSON file");
+    }
+    fs::rename(temp_path, json_path, err);
+    if(err)
+    {
+        fs::remove(temp_path, err);
         return std::unexpected("Failed to write metadata JSON file");
     }
-    file.close();
     return {};
 }
+
+E<PhotoMetadata> readMetadata(const fs::path& json_path)
+{
+    nlohmann::json data = nlohmann::json::parse(std::ifstream(json_path),
+                                                nullptr, false);
+    if(data.is_discarded())
+    {
+        return std::unexpected("Invalid JSON");
+    }
+    return PhotoMetadata::fromJson(data);
+}
+
+std::optional<PhotoMetadata> MetadataCache::get(const std::string& id,
+                                                const fs::path& photo_path,
+                                                const fs::path& json_path)
+{
+    std::shared_lock<std::shared_mutex> l(lock);
+    auto found = cache.find(id);
+    if(found == std::end(cache))
+    {
+        return std::nullopt;
+    }
+    // In the cache dir, the metadata of an edited photo goes to a new
+    // path, and the old file stays as it is.
+    if(found->second.json_path != json_path)
+    {
+        return std::nullopt;
+    }
+    std::error_code err;
+    auto mtime = fs::last_write_time(json_path, err);
+    if(err || mtime != found->second.mtime)
+    {
+        return std::nullopt;
+    }
+    auto photo_mtime = fs::last_write_time(photo_path, err);
+    if(err || photo_mtime != found->second.photo_mtime)
+    {
+        return std::nullopt;
+    }
+    return found->second.metadata;
+}
+
+E<PhotoMetadata> MetadataCache::load(const std::string& id,
+                                     const fs::path& photo_path,
+                                     const fs::path& json_path)
+{
+    std::error_code err;
+    auto photo_mtime = fs::last_write_time(photo_path, err);
+    if(err)
+    {
+        return std::unexpected(std::format("Failed to stat {}: {}",
+                                           photo_path.string(),
+                                           err.message()));
+    }
+    auto mtime = fs::last_write_time(json_path, err);
+    if(err)
+    {
+        return std::unexpected(std::format("Failed to stat {}: {}",
+                                           json_path.string(), err.message()));
+    }
+    auto metadata = readMetadata(json_path);
+    if(!metadata.has_value())
+    {
+        return std::unexpected(metadata.error());
+    }
+    std::unique_lock<std::shared_mutex> l(lock);
+    cache.insert_or_assign(id, Entry{*metadata, json_path, mtime,
+                                     photo_mtime});
+    return metadata;
+}
+
+bool MetadataCache::contains(const std::string& id)
+{
+    std::shared_lock<std::shared_mutex> l(lock);
+    return cache.contains(id);
+}
+
+nlohmann::json MetadataCache::toJson()
+{
+    nlohmann::json data = nlohmann::json::value_t::object;
+    std::shared_lock<std::shared_mutex> l(lock);
+    for(const auto& [id, entry]: cache)
+    {
+        data[id] = {
+            {"metadata", entry.metadata.toJson()},
+            {"json_path", entry.json_path.string()},
+            {"mtime", entry.mtime.time_since_epoch().count()},
+            {"photo_mtime", entry.photo_mtime.time_since_epoch().count()}};
+    }
+    return data;
+}
+
+void MetadataCache::loadJson(const nlohmann::json& data)
+{
+    if(!data.is_object())
+    {
+        return;
+    }
+    std::unique_lock<std::shared_mutex> l(lock);
+    for(const auto& [id, entry]: data.items())
+    {
+        if(!entry.contains("json_path") || !entry.contains("mtime") ||
+           !entry.contains("photo_mtime"))
+        {
+            continue;
+        }
+        fs::file_time_type mtime{fs::file_time_type::duration(
+            entry["mtime"].get<fs::file_time_type::rep>())};
+        fs::file_time_type photo_mtime{fs::file_time_type::duration(
+            entry["photo_mtime"].get<fs::file_time_type::rep>())};
+        cache.insert_or_assign(
+            id, Entry{PhotoMetadata::fromJson(entry.value("metadata",
+                                                           nlohmann::json())),
+                      entry["json_path"].get<std::string>(), mtime,
+                      photo_mtime});
+    }
+}
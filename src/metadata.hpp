@@ -1,11 +1,47 @@
 #pragma once
 
 #include <filesystem>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json.hpp>
 
 #include "file_cache.hpp"
 #include "utils.hpp"
 #include "config.hpp"
 
+// Run a program with arguments “args” (the first being the program,
+// which is searched in PATH), and return its standard output. No
+// shell is involved, so the arguments need no quoting.
+E<std::vector<char>> runOutput(const std::vector<std::string>& args);
+
+// Normalized metadata of a photo. Numeric fields are kept in their
+// JSON text form, since they are only displayed. Absent fields are
+// empty.
+struct PhotoMetadata
+{
+    std::string make;
+    std::string model;
+    std::string f_number;
+    std::string exposure_time;
+    std::string iso;
+    std::string focal_length;
+    std::string lens;
+    std::string headline;
+    std::string title;
+    std::string caption;
+
+    static PhotoMetadata fromJson(const nlohmann::json& data);
+    // Convert to JSON in the format of the metadata JSON files.
+    nlohmann::json toJson() const;
+};
+
+// Parse a metadata JSON file.
+E<PhotoMetadata> readMetadata(const std::filesystem::path& json_path);
+
 class MetadataManager: public FileCache
 {
 public:
@@ -13,6 +49,18 @@ public:
     explicit MetadataManager(const Configuration& conf);
     ~MetadataManager() override = default;
 
+    // Path of the metadata JSON file of a photo, without generating
+    // it.
+    std::filesystem::path jsonPath(const std::filesystem::path& path)
+    {
+        return getPath(path);
+    }
+    // Whether the metadata of a photo is extracted and up to date.
+    bool hasMetadata(const std::filesystem::path& path)
+    {
+        return isFresh(path);
+    }
+
 protected:
     std::filesystem::path getPath(const std::filesystem::path& path) override;
     bool isFresh(const std::filesystem::path& path) override;
@@ -21,3 +69,40 @@ protected:
 private:
     const Configuration& config;
 };
+
+// An in-memory cache of parsed metadata, keyed by photo ID. Entries
+// are validated against the path and mtime of their JSON files, and
+// the mtime of their photos, so that an edited photo is not served
+// the metadata of its old version.
+class MetadataCache
+{
+public:
+    // Return the cached metadata of photo “id” at “photo_path”, if it
+    // was loaded from “json_path” and neither has changed since.
+    std::optional<PhotoMetadata> get(const std::string& id,
+                                     const std::filesystem::path& photo_path,
+                                     const std::filesystem::path& json_path);
+    // Parse the metadata of photo “id” at “photo_path” from
+    // “json_path”, and cache it.
+    E<PhotoMetadata> load(const std::string& id,
+                          const std::filesystem::path& photo_path,
+                          const std::filesystem::path& json_path);
+    bool contains(const std::string& id);
+    // Convert all entries to JSON for a snapshot, and load them
+    // back. Loaded entries are validated when they are got, like any
+    // other.
+    nlohmann::json toJson();
+    void loadJson(const nlohmann::json& data);
+
+private:
+    struct Entry
+    {
+        PhotoMetadata metadata;
+        std::filesystem::path json_path;
+        std::filesystem::file_time_type mtime;
+        std::filesystem::file_time_type photo_mtime;
+    };
+
+    std::unordered_map<std::string, Entry> cache;
+    std::shared_mutex lock;
+};
@@ -0,0 +1,468 @@
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <shared_mutex>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "pack_store.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+
+constexpr std::string_view PACK_MAGIC = "NSGPACK1";
+constexpr std::string_view PACK_INDEX_MAGIC = "NSGPIDX2";
+// Both the pack and the index start with a magic string and the
+// generation.
+constexpr uint64_t PACK_HEADER_SIZE = 16;
+// Offset of index records marking an erased key.
+constexpr uint64_t PACK_TOMBSTONE = ~0ull;
+
+FileMapping::FileMapping(int fd, size_t size)
+{
+    if(size == 0)
+    {
+        return;
+    }
+    void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED)
+    {
+        spdlog::error("Failed to map file: {}", std::strerror(errno));
+        return;
+    }
+    addr = static_cast<const char*>(p);
+    length = size;
+}
+
+FileMapping::~FileMapping()
+{
+    if(addr != nullptr)
+    {
+        munmap(const_cast<char*>(addr), length);
+    }
+}
+
+// Write all of “data” to “fd” at “offset”.
+E<void> pwriteAll(int fd, std::string_view data, uint64_t offset)
+{
+    while(!data.empty())
+    {
+        ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return std::unexpected(std::format("Failed to write pack: {}",
+                                               std::strerror(errno)));
+        }
+        data.remove_prefix(written);
+        offset += written;
+    }
+    return {};
+}
+
+std::string packHeader(std::string_view magic, uint64_t generation)
+{
+    std::string header(magic);
+    header.append(reinterpret_cast<const char*>(&generation),
+                  sizeof(generation));
+    return header;
+}
+
+// Return the generation in the header of “fd”, if the header is
+// valid.
+std::optional<uint64_t> readPackHeader(int fd, std::string_view magic)
+{
+    std::array<char, PACK_HEADER_SIZE> header;
+    if(pread(fd, header.data(), header.size(), 0) !=
+       static_cast<ssize_t>(header.size()) ||
+       std::string_view(header.data(), magic.size()) != magic)
+    {
+        return std::nullopt;
+    }
+    uint64_t generation;
+    std::memcpy(&generation, header.data() + magic.size(),
+                sizeof(generation));
+    return generation;
+}
+
+uint64_t newPackGeneration()
+{
+    return std::chrono::system_clock::now().time_since_epoch().count();
+}
+
+PackStore::PackStore(const fs::path& base)
+        : pack_path(fs::path(base).concat(".pack")),
+          index_path(fs::path(base).concat(".idx"))
+{
+    auto status = open();
+    if(!status.has_value())
+    {
+        spdlog::error("Failed to open pack {}: {}", pack_path.string(),
+                      status.error());
+        close();
+    }
+}
+
+PackStore::~PackStore()
+{
+    close();
+}
+
+E<void> PackStore::open()
+{
+    std::error_code err;
+    fs::create_directories(pack_path.parent_path(), err);
+    pack_fd = ::open(pack_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    index_fd = ::open(index_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(pack_fd < 0 || index_fd < 0)
+    {
+        return std::unexpected(std::strerror(errno));
+    }
+    struct stat st;
+    if(fstat(pack_fd, &st) != 0)
+    {
+        return std::unexpected(std::strerror(errno));
+    }
+    pack_size = st.st_size;
+    if(fstat(index_fd, &st) != 0)
+    {
+        return std::unexpected(std::strerror(errno));
+    }
+    uint64_t index_size = st.st_size;
+    if(pack_size == 0 && index_size == 0)
+    {
+        return reset();
+    }
+
+    auto pack_generation = readPackHeader(pack_fd, PACK_MAGIC);
+    auto index_generation = readPackHeader(index_fd, PACK_INDEX_MAGIC);
+    if(!pack_generation.has_value() || !index_generation.has_value() ||
+       *pack_generation != *index_generation)
+    {
+        spdlog::warn("Pack {} does not match its index, starting over.",
+                     pack_path.string());
+        return reset();
+    }
+    generation = *pack_generation;
+
+    FileMapping index(index_fd, index_size);
+    if(index.size() != index_size)
+    {
+        return std::unexpected("Failed to map pack index");
+    }
+    const size_t count = (index.size() - PACK_HEADER_SIZE) / sizeof(Record);
+    for(size_t i = 0; i < count; i++)
+    {
+        Record record;
+        std::memcpy(&record, index.data() + PACK_HEADER_SIZE +
+                    i * sizeof(Record), sizeof(Record));
+        removeRecord(record.key);
+        // The pack could be shorter than the index says if we crashed
+        // in the middle of an append.
+        if(record.offset != PACK_TOMBSTONE &&
+           record.offset >= PACK_HEADER_SIZE &&
+           record.offset + record.length <= pack_size)
+        {
+            addRecord(record);
+        }
+    }
+    // Drop a partially written record at the end.
+    const uint64_t valid_size = PACK_HEADER_SIZE + count * sizeof(Record);
+    if(valid_size != index_size && ftruncate(index_fd, valid_size) != 0)
+    {
+        return std::unexpected(std::strerror(errno));
+    }
+    spdlog::info("Loaded pack {} with {} blobs.", pack_path.string(),
+                 records.size());
+    return {};
+}
+
+E<void> PackStore::reset()
+{
+    records.clear();
+    slots.clear();
+    dead_size = 0;
+    if(ftruncate(pack_fd, 0) != 0 || ftruncate(index_fd, 0) != 0)
+    {
+        return std::unexpected(std::strerror(errno));
+    }
+    generation = newPackGeneration();
+    auto status = pwriteAll(pack_fd, packHeader(PACK_MAGIC, generation), 0);
+    if(!status.has_value())
+    {
+        return status;
+    }
+    pack_size = PACK_HEADER_SIZE;
+    return pwriteAll(index_fd, packHeader(PACK_INDEX_MAGIC, generation), 0);
+}
+
+void PackStore::close()
+{
+    if(pack_fd >= 0)
+    {
+        ::close(pack_fd);
+        pack_fd = -1;
+    }
+    if(index_fd >= 0)
+    {
+        ::close(index_fd);
+        index_fd = -1;
+    }
+}
+
+std::optional<PackBlob> PackStore::get(uint64_t key)
+{
+    std::shared_lock<std::shared_mutex> l(lock);
+    auto found = records.find(key);
+    if(found == std::end(records))
+    {
+        return std::nullopt;
+    }
+    const Record& record = found->second;
+    auto m = mappingUpTo(record.offset + record.length);
+    if(m->size() < record.offset + record.length)
+    {
+        return std::nullopt;
+    }
+    return PackBlob{m, m->data() + record.offset, record.length, record.etag};
+}
+
+E<void> PackStore::put(uint64_t key, std::string_view data, uint64_t slot)
+{
+    std::lock_guard<std::mutex> wl(write_lock);
+    if(pack_fd < 0 || index_fd < 0)
+    {
+        return std::unexpected("Pack is not open");
+    }
+    Record record{key, slot, pack_size, data.size(), fnv1a(data)};
+    auto status = pwriteAll(pack_fd, data, record.offset);
+    if(!status.has_value())
+    {
+        return status;
+    }
+    status = appendRecord(record);
+    if(!status.has_value())
+    {
+        return status;
+    }
+
+    std::unique_lock<std::shared_mutex> l(lock);
+    pack_size += data.size();
+    addRecord(record);
+    return {};
+}
+
+void PackStore::erase(uint64_t key)
+{
+    std::lock_guard<std::mutex> wl(write_lock);
+    {
+        std::unique_lock<std::shared_mutex> l(lock);
+        if(!removeRecord(key))
+        {
+            return;
+        }
+    }
+    auto status = appendRecord(Record{key, 0, PACK_TOMBSTONE, 0, 0});
+    if(!status.has_value())
+    {
+        spdlog::error("Failed to erase from pack: {}", status.error());
+    }
+}
+
+void PackStore::eraseSlot(uint64_t slot)
+{
+    uint64_t key;
+    {
+        std::shared_lock<std::shared_mutex> l(lock);
+        auto found = slots.find(slot);
+        if(found == std::end(slots))
+        {
+            return;
+        }
+        key = found->second;
+    }
+    erase(key);
+}
+
+void PackStore::addRecord(const Record& record)
+{
+    removeRecord(record.key);
+    if(record.slot != 0)
+    {
+        auto found = slots.find(record.slot);
+        if(found != std::end(slots))
+        {
+            removeRecord(found->second);
+        }
+        slots[record.slot] = record.key;
+    }
+    records.emplace(record.key, record);
+}
+
+bool PackStore::removeRecord(uint64_t key)
+{
+    auto found = records.find(key);
+    if(found == std::end(records))
+    {
+        return false;
+    }
+    dead_size += found->second.length;
+    auto slot = slots.find(found->second.slot);
+    if(slot != std::end(slots) && slot->second == key)
+    {
+        slots.erase(slot);
+    }
+    records.erase(found);
+    return true;
+}
+
+E<void> PackStore::compact()
+{
+    std::lock_guard<std::mutex> wl(write_lock);
+    std::unordered_map<uint64_t, Record> live;
+    std::shared_ptr<const FileMapping> old_mapping;
+    {
+        std::shared_lock<std::shared_mutex> l(lock);
+        if(pack_fd < 0 || dead_size * 2 <= pack_size)
+        {
+            return {};
+        }
+        live = records;
+        old_mapping = mappingUpTo(pack_size);
+    }
+    spdlog::info("Compacting pack {} ({} of {} bytes are dead)...",
+                 pack_path.string(), dead_size, pack_size);
+
+    // Readers are not blocked while the new pack is being written,
+    // and writers are blocked by “write_lock”.
+    fs::path new_pack_path = fs::path(pack_path).concat(".tmp");
+    fs::path new_index_path = fs::path(index_path).concat(".tmp");
+    int new_pack_fd = ::open(new_pack_path.c_str(),
+                             O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int new_index_fd = ::open(new_index_path.c_str(),
+                              O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    auto fail = [&](std::string msg) -> E<void>
+    {
+        if(new_pack_fd >= 0) { ::close(new_pack_fd); }
+        if(new_index_fd >= 0) { ::close(new_index_fd); }
+        std::error_code err;
+        fs::remove(new_pack_path, err);
+        fs::remove(new_index_path, err);
+        return std::unexpected(std::move(msg));
+    };
+    if(new_pack_fd < 0 || new_index_fd < 0)
+    {
+        return fail(std::strerror(errno));
+    }
+
+    const uint64_t new_generation = newPackGeneration();
+    auto status = pwriteAll(new_pack_fd,
+                            packHeader(PACK_MAGIC, new_generation), 0);
+    if(!status.has_value())
+    {
+        return fail(status.error());
+    }
+    uint64_t new_size = PACK_HEADER_SIZE;
+    std::string index_data = packHeader(PACK_INDEX_MAGIC, new_generation);
+    index_data.reserve(PACK_HEADER_SIZE + live.size() * sizeof(Record));
+    for(auto& [key, record]: live)
+    {
+        if(record.offset + record.length > old_mapping->size())
+        {
+            return fail("Pack is shorter than its index");
+        }
+        status = pwriteAll(
+            new_pack_fd, std::string_view(
+                old_mapping->data() + record.offset, record.length),
+            new_size);
+        if(!status.has_value())
+        {
+            return fail(status.error());
+        }
+        record.offset = new_size;
+        new_size += record.length;
+        index_data.append(reinterpret_cast<const char*>(&record),
+                          sizeof(Record));
+    }
+    status = pwriteAll(new_index_fd, index_data, 0);
+    if(!status.has_value())
+    {
+        return fail(status.error());
+    }
+    if(fsync(new_pack_fd) != 0 || fsync(new_index_fd) != 0)
+    {
+        return fail(std::strerror(errno));
+    }
+    std::error_code err;
+    fs::rename(new_pack_path, pack_path, err);
+    if(err)
+    {
+        return fail(std::format("Failed to replace pack: {}", err.message()));
+    }
+    // The new pack is in place, so the new files are used from here
+    // on, even if the index cannot be replaced. If it cannot, or if
+    // we crash before it is, the generations do not match on the
+    // next start, and the pack is started over.
+    fs::rename(new_index_path, index_path, err);
+    if(err)
+    {
+        spdlog::error("Failed to replace pack index {}: {}",
+                      index_path.string(), err.message());
+    }
+
+    std::unique_lock<std::shared_mutex> l(lock);
+    close();
+    pack_fd = new_pack_fd;
+    index_fd = new_index_fd;
+    generation = new_generation;
+    pack_size = new_size;
+    dead_size = 0;
+    records = std::move(live);
+    {
+        std::lock_guard<std::mutex> ml(mapping_lock);
+        mapping.reset();
+    }
+    spdlog::info("Compacted pack {} to {} bytes.", pack_path.string(),
+                 new_size);
+    return {};
+}
+
+E<void> PackStore::appendRecord(const Record& record)
+{
+    struct stat st;
+    if(fstat(index_fd, &st) != 0)
+    {
+        return std::unexpected(std::strerror(errno));
+    }
+    return pwriteAll(
+        index_fd, std::string_view(reinterpret_cast<const char*>(&record),
+                                   sizeof(Record)),
+        st.st_size);
+}
+
+std::shared_ptr<const FileMapping> PackStore::mappingUpTo(uint64_t end)
+{
+    std::lock_guard<std::mutex> ml(mapping_lock);
+    if(mapping == nullptr || mapping->size() < end)
+    {
+        mapping = std::make_shared<const FileMapping>(pack_fd, pack_size);
+    }
+    return mapping;
+}
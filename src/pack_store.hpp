@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+
+#include "utils.hpp"
+
+// Packs live in this directory, under the runtime data dir of the
+// photo root, or the cache dir. This is hidden so that it is skipped
+// by the cache GC.
+constexpr std::string_view PACK_DIR = ".packs";
+
+// A read-only memory mapping of a file.
+class FileMapping
+{
+public:
+    FileMapping() = delete;
+    FileMapping(int fd, size_t size);
+    FileMapping(const FileMapping&) = delete;
+    FileMapping& operator=(const FileMapping&) = delete;
+    ~FileMapping();
+
+    const char* data() const { return addr; }
+    size_t size() const { return length; }
+
+private:
+    const char* addr = nullptr;
+    size_t length = 0;
+};
+
+// A blob in a pack. It keeps the mapping of the pack alive, so it
+// stays valid even if the pack is remapped or compacted.
+struct PackBlob
+{
+    std::shared_ptr<const FileMapping> mapping;
+    const char* data = nullptr;
+    size_t size = 0;
+    uint64_t etag = 0;
+};
+
+// An append-only store of small blobs, keyed by 64-bit keys. Blobs
+// are appended to a pack file, and each append also appends a fixed
+// size record (key, slot, offset, length, etag) to an index file. On
+// startup the index is mapped and read into memory; later records of
+// the same key or the same slot supersede earlier ones. Blobs are
+// served directly from a mapping of the pack. Superseded and erased
+// blobs are dropped by compact().
+//
+// Slots identify what a blob is for (e.g. the thumbnail of a certain
+// photo), while keys identify its content (which also depends on the
+// mtime of the photo and the config). A new blob in a slot therefore
+// makes the old one dead, even though their keys differ.
+//
+// Both files start with the same generation number, which changes
+// when the pack is compacted. If they differ on startup (e.g. the
+// process died while replacing them), the pack is started over.
+class PackStore
+{
+public:
+    PackStore() = delete;
+    // Open or create a pack “<base>.pack” with index “<base>.idx”.
+    explicit PackStore(const std::filesystem::path& base);
+    PackStore(const PackStore&) = delete;
+    PackStore& operator=(const PackStore&) = delete;
+    ~PackStore();
+
+    std::optional<PackBlob> get(uint64_t key);
+    // Store “data” with “key”, in “slot”. Zero means no slot.
+    E<void> put(uint64_t key, std::string_view data, uint64_t slot = 0);
+    void erase(uint64_t key);
+    // Erase the blob in “slot”, if any.
+    void eraseSlot(uint64_t slot);
+    // Rewrite the pack without dead blobs, if they take up more than
+    // half of it.
+    E<void> compact();
+
+private:
+    struct Record
+    {
+        uint64_t key;
+        uint64_t slot;
+        uint64_t offset;
+        uint64_t length;
+        uint64_t etag;
+    };
+
+    E<void> open();
+    // Truncate the pack and the index, and write their headers with a
+    // new generation.
+    E<void> reset();
+    void close();
+    E<void> appendRecord(const Record& record);
+    // Add “record” to the records in memory, and account for the
+    // blobs it supersedes. Must be called with “lock” held.
+    void addRecord(const Record& record);
+    // Remove the record of “key” from memory. Must be called with
+    // “lock” held. Return false if there is none.
+    bool removeRecord(uint64_t key);
+    // Return a mapping of the pack covering at least “end” bytes.
+    // Must be called with “lock” held.
+    std::shared_ptr<const FileMapping> mappingUpTo(uint64_t end);
+
+    const std::filesystem::path pack_path;
+    const std::filesystem::path index_path;
+    int pack_fd = -1;
+    int index_fd = -1;
+    uint64_t generation = 0;
+    uint64_t pack_size = 0;
+    uint64_t dead_size = 0;
+    std::unordered_map<uint64_t, Record> records;
+    // Key of the blob in each slot.
+    std::unordered_map<uint64_t, uint64_t> slots;
+    std::shared_ptr<const FileMapping> mapping;
+    // Guards “records” and the pack size.
+    std::shared_mutex lock;
+    // Serializes writes to the pack and the index.
+    std::mutex write_lock;
+    // Guards the mapping, which can be replaced by readers.
+    std::mutex mapping_lock;
+};
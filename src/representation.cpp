@@ -1,22 +1,207 @@
+#include <algorithm>
 #include <expected>
 #include <filesystem>
 #include <format>
+#include <fstream>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <stdint.h>
 
 #include <Magick++.h>
+#include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 
+#include "content_key.hpp"
+#include "memory_budget.hpp"
+#include "metadata.hpp"
 #include "representation.hpp"
+#include "request_timer.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 namespace fs = std::filesystem;
 
-E<void> imgResize(const std::string& source, const std::string& result,
-                  int quality, uint32_t size)
+bool isRawFile(std::string_view name)
 {
+    std::string ext = asciiLower(fs::path(name).extension().string());
+    return ext == ".cr2" || ext == ".cr3" || ext == ".nef" || ext == ".arw"
+        || ext == ".dng" || ext == ".orf" || ext == ".rw2" || ext == ".raf"
+        || ext == ".pef" || ext == ".srw";
+}
+
+std::unique_ptr<MemoryBudget> decode_budget;
+
+void setDecodeBudget(uint64_t bytes)
+{
+    if(bytes == 0)
+    {
+        decode_budget.reset();
+    }
+    else
+    {
+        decode_budget = std::make_unique<MemoryBudget>(bytes);
+    }
+}
+
+// Estimated memory to decode an image of “columns” × “rows” pixels.
+// ImageMagick keeps 4 channels of quanta per pixel regardless of the
+// depth of the source.
+uint64_t decodeMemory(uint64_t columns, uint64_t rows)
+{
+    return columns * rows * 4 * sizeof(Magick::Quantum);
+}
+
+// Read the smallest preview embedded in the RAW file “source” that is
+// at least “size” pixels on its longer side, or the largest one if
+// none is large enough, using exiftool. RAW files embed JPEG
+// previews, often of full size. Previews do not carry the orientation
+// of the photo, so it is applied here.
+std::optional<Magick::Image> readEmbeddedPreview(std::string_view exiftool,
+                                                 const std::string& source,
+                                                 uint32_t size)
+{
+    auto output = runOutput({std::string(exiftool), "-json", "-b",
+                             "-Orientation#", "-PreviewImage", "-JpgFromRaw",
+                             source});
+    if(!output.has_value())
+    {
+        return std::nullopt;
+    }
+    nlohmann::json data = nlohmann::json::parse(*output, nullptr, false);
+    if(data.is_discarded() || !data.is_array() || data.empty())
+    {
+        return std::nullopt;
+    }
+    // With “-b”, exiftool encodes binary values in base64 in JSON.
+    constexpr std::string_view prefix = "base64:";
+    std::optional<Magick::Image> result;
+    for(const char* tag: {"PreviewImage", "JpgFromRaw"})
+    {
+        auto found = data[0].find(tag);
+        if(found == data[0].end() || !found->is_string())
+        {
+            continue;
+        }
+        const std::string& value = found->get_ref<const std::string&>();
+        if(!value.starts_with(prefix))
+        {
+            continue;
+        }
+        Magick::Blob blob;
+        blob.base64(value.substr(prefix.size()));
+        Magick::Image img;
+        try
+        {
+            img.read(blob);
+        }
+        catch(Magick::Warning&) {}
+        catch(Magick::Error&)
+        {
+            continue;
+        }
+        const size_t longest = std::max(img.columns(), img.rows());
+        const size_t best = result.has_value() ?
+            std::max(result->columns(), result->rows()) : 0;
+        // Take this one if it is large enough and smaller than the best
+        // so far, or if the best so far is too small and this is
+        // larger.
+        if(!result.has_value() ||
+           (longest >= size && (best < size || longest < best)) ||
+           (best < size && longest > best))
+        {
+            spdlog::debug("Using embedded {} of {}.", tag, source);
+            result = std::move(img);
+        }
+    }
+    if(!result.has_value())
+    {
+        return std::nullopt;
+    }
+    auto orientation = data[0].find("Orientation");
+    if(orientation != data[0].end() && orientation->is_number_integer())
+    {
+        result->orientation(static_cast<Magick::OrientationType>(
+            orientation->get<int>()));
+        result->autoOrient();
+    }
+    return result;
+}
+
+// Strip the image of metadata except the color profile, and fit it
+// into “size” × “size”.
+void finishResized(Magick::Image& img, int quality, uint32_t size)
+{
+    auto profile = img.iccColorProfile();
+    img.strip();
+    img.resize(std::format("{}x{}>", size, size));
+    img.quality(quality);
+    img.iccColorProfile(profile);
+}
+
+E<Magick::Image> readResized(const std::string& source, int quality,
+                             uint32_t size, std::string_view exiftool)
+{
+    if(!exiftool.empty())
+    {
+        auto preview = readEmbeddedPreview(exiftool, source, size);
+        if(preview.has_value())
+        {
+            finishResized(*preview, quality, size);
+            return *std::move(preview);
+        }
+    }
+
+    // Ping the header first to plan the decode.
+    Magick::Image header;
+    try
+    {
+        header.ping(source);
+    }
+    catch(Magick::WarningCoder&) {}
+    catch(Magick::Warning&) {}
+    catch(Magick::ErrorFileOpen&)
+    {
+        return std::unexpected(std::format("Failed to open image {}.", source));
+    }
+    uint64_t columns = header.columns();
+    uint64_t rows = header.rows();
+
     Magick::Image img;
+    // The JPEG decoder can scale down by up to 8 while decoding, which
+    // saves most of the memory and time for large photos. Decode to
+    // at least twice the target size to keep the quality of the
+    // final resize.
+    const uint64_t hint = 2 * static_cast<uint64_t>(size);
+    const uint64_t longest = std::max(columns, rows);
+    if(header.magick() == "JPEG" && longest > hint)
+    {
+        img.defineValue("jpeg", "size", std::format(
+            "{}x{}", columns * hint / longest, rows * hint / longest));
+        uint64_t scale = 1;
+        while(scale < 8 && longest / (scale * 2) >= hint)
+        {
+            scale *= 2;
+        }
+        columns = (columns + scale - 1) / scale;
+        rows = (rows + scale - 1) / scale;
+    }
+
+    std::optional<MemoryBudget::Grant> grant;
+    if(decode_budget != nullptr)
+    {
+        const uint64_t need = decodeMemory(columns, rows);
+        if(need > decode_budget->capacity())
+        {
+            spdlog::info("Image {} needs {} MiB to decode, which is more "
+                         "than the budget. It will be decoded alone.",
+                         source, need >> 20);
+        }
+        grant.emplace(decode_budget->acquire(need));
+    }
     try
     {
         img.read(source);
@@ -27,35 +212,186 @@ E<void> imgResize(const std::string& source, const std::string& result,
     {
         return std::unexpected(std::format("Failed to open image {}.", source));
     }
-    auto profile = img.iccColorProfile();
-    img.strip();
-    img.resize(std::format("{}x{}>", size, size));
-    img.quality(quality);
-    img.iccColorProfile(profile);
-    img.write(result);
+    finishResized(img, quality, size);
+    return img;
+}
+
+E<Magick::Image> imgResize(const std::string& source, int quality,
+                           uint32_t size, std::string_view exiftool)
+{
+    TRACE_SCOPE("imgResize");
+    return readResized(source, quality, size, exiftool);
+}
+
+Placeholder makePlaceholder(const Magick::Image& thumb)
+{
+    Magick::Image tiny(thumb);
+    tiny.resize(std::format("{}x{}>", PLACEHOLDER_SIZE, PLACEHOLDER_SIZE));
+    tiny.strip();
+    tiny.magick("WEBP");
+    tiny.quality(PLACEHOLDER_QUALITY);
+    Magick::Blob blob;
+    tiny.write(&blob);
+    return {static_cast<uint32_t>(thumb.columns()),
+            static_cast<uint32_t>(thumb.rows()),
+            "data:image/webp;base64," + blob.base64()};
+}
+
+nlohmann::json Placeholder::toJson() const
+{
+    return {{"width", width}, {"height", height}, {"data", data_uri}};
+}
+
+std::optional<Placeholder> Placeholder::fromJson(const nlohmann::json& data)
+{
+    if(!data.is_object())
+    {
+        return std::nullopt;
+    }
+    Placeholder result;
+    try
+    {
+        result.width = data.at("width").get<uint32_t>();
+        result.height = data.at("height").get<uint32_t>();
+        result.data_uri = data.at("data").get<std::string>();
+    }
+    catch(const nlohmann::json::exception&)
+    {
+        return std::nullopt;
+    }
+    return result;
+}
 
+E<void> makeSprite(const std::vector<std::string_view>& tiles,
+                   uint32_t cell_size, int quality,
+                   ImageFormat::Value format, const std::string& result)
+{
+    PhaseTimer timer(RequestTimer::GENERATE);
+    TRACE_SCOPE("makeSprite");
+    if(tiles.empty())
+    {
+        return std::unexpected("Empty sprite");
+    }
+    const size_t rows = (tiles.size() + SPRITE_COLUMNS - 1) / SPRITE_COLUMNS;
+    const size_t columns = std::min<size_t>(tiles.size(), SPRITE_COLUMNS);
+    // JPEG has no transparency, and transparent pixels would be
+    // written in whatever color they happen to have.
+    const bool opaque = format == ImageFormat::JPEG;
+    Magick::Image sprite(Magick::Geometry(columns * cell_size,
+                                          rows * cell_size),
+                         Magick::Color(opaque ?
+                                       std::string(SPRITE_OPAQUE_BACKGROUND) :
+                                       "transparent"));
+    if(opaque)
+    {
+        sprite.alpha(false);
+    }
+    for(size_t i = 0; i < tiles.size(); i++)
+    {
+        if(tiles[i].empty())
+        {
+            continue;
+        }
+        Magick::Image tile;
+        try
+        {
+            tile.read(Magick::Blob(tiles[i].data(), tiles[i].size()));
+        }
+        catch(Magick::Warning&) {}
+        catch(Magick::Error& e)
+        {
+            spdlog::warn("Failed to read sprite tile: {}", e.what());
+            continue;
+        }
+        const ssize_t cell = cell_size;
+        ssize_t x = (i % SPRITE_COLUMNS) * cell +
+            (cell - static_cast<ssize_t>(tile.columns())) / 2;
+        ssize_t y = (i / SPRITE_COLUMNS) * cell +
+            (cell - static_cast<ssize_t>(tile.rows())) / 2;
+        sprite.composite(tile, x, y, Magick::OverCompositeOp);
+    }
+    sprite.quality(quality);
+    // Set explicitly, instead of relying on the extension of the file.
+    sprite.magick(std::string(ImageFormat::toMagick(format)));
+    const fs::path result_path(result);
+    const fs::path temp_path = tempPathFor(result_path);
+    sprite.write(temp_path.string());
+    std::error_code err;
+    fs::rename(temp_path, result_path, err);
+    if(err)
+    {
+        fs::remove(temp_path, err);
+        return std::unexpected(std::format("Failed to write sprite {}: {}",
+                                           result, err.message()));
+    }
     return {};
 }
 
-ReprManager::ReprManager(Representation::Type type, const Configuration& conf)
-        : repr_type(type), config(conf)
+fs::path packDir(const Configuration& config)
 {
+    return config.cache_dir.empty() ?
+        fs::path(config.photo_root_dir) / RUNTIME_DATA_DIR / PACK_DIR :
+        fs::path(config.cache_dir) / PACK_DIR;
 }
 
-std::filesystem::path ReprManager::getPath(const fs::path& path)
+ReprManager::ReprManager(Representation::Type type, const Configuration& conf,
+                         std::optional<ImageFormat::Value> format)
+        : repr_type(type), config(conf), format_override(format)
+{
+    if(type == Representation::THUMB && conf.thumb_pack && !format.has_value())
+    {
+        pack = std::make_unique<PackStore>(
+            packDir(conf) / Representation::str(type));
+    }
+}
+
+ReprManager::Params ReprManager::params() const
 {
-    fs::path base_name = path.stem();
-    fs::path data_dir = path.parent_path() / RUNTIME_DATA_DIR;
-    std::string_view ext;
     switch(repr_type)
     {
     case Representation::THUMB:
-        ext = ImageFormat::toExt(config.thumb_format);
-        break;
+        return {format_override.value_or(config.thumb_format),
+                config.thumb_quality, config.thumb_size};
     case Representation::PRESENT:
-        ext = ImageFormat::toExt(config.present_format);
-        break;
+        return {format_override.value_or(config.present_format),
+                config.present_quality, config.present_size};
+    }
+    std::unreachable();
+}
+
+std::string_view ReprManager::previewTool(const fs::path& path) const
+{
+    // RAW files are always read from their previews, since ImageMagick
+    // may not be able to decode them. Other photos are decoded, which
+    // is faster than running exiftool for JPEGs, since they are
+    // decoded at a reduced scale.
+    if(isRawFile(path.filename().string()))
+    {
+        return config.exiftool_path;
     }
+    return {};
+}
+
+std::string ReprManager::fingerprint() const
+{
+    Params p = params();
+    return std::format(
+        "{}:{}:{}:{}", Representation::str(repr_type), p.size, p.quality,
+        ImageFormat::toExt(p.format));
+}
+
+std::filesystem::path ReprManager::getPath(const fs::path& path)
+{
+    std::string_view ext = ImageFormat::toExt(params().format);
+    if(!config.cache_dir.empty())
+    {
+        return shardedCachePath(
+            config.cache_dir, sourceKey(path, config), fingerprint(),
+            std::format("-{}.{}", Representation::str(repr_type), ext));
+    }
+
+    fs::path base_name = path.stem();
+    fs::path data_dir = path.parent_path() / RUNTIME_DATA_DIR;
     return data_dir / std::format(
         "{}-{}.{}", base_name.string(), Representation::str(repr_type),
         ext);
@@ -63,31 +399,275 @@ std::filesystem::path ReprManager::getPath(const fs::path& path)
 
 bool ReprManager::isFresh(const fs::path& path)
 {
-    return fs::exists(getPath(path));
+    if(!config.cache_dir.empty())
+    {
+        // The path changes with the photo.
+        return fs::exists(getPath(path));
+    }
+    return isOutputCurrent(getPath(path), path);
 }
 
 E<void> ReprManager::refresh(const fs::path& path)
 {
+    PhaseTimer timer(RequestTimer::GENERATE);
+    // A copy of the photo may have it generated already.
+    resolveSourceKey(path, config);
+    if(isFresh(path))
+    {
+        return {};
+    }
     fs::path repr_path = getPath(path);
     fs::path dir = repr_path.parent_path();
     if(!fs::exists(dir))
     {
-        fs::create_directory(dir);
+        fs::create_directories(dir);
     }
     std::string path_str = path.string();
     spdlog::debug("Generating presentation for {}...", path_str);
-    int quality = 0;
-    uint32_t size = 0;
-    switch(repr_type)
+    Params p = params();
+    auto img = imgResize(path_str, p.quality, p.size, previewTool(path));
+    if(!img.has_value())
     {
-    case Representation::THUMB:
-        quality = config.thumb_quality;
-        size = config.thumb_size;
-        break;
-    case Representation::PRESENT:
-        quality = config.present_quality;
-        size = config.present_size;
-        break;
+        return std::unexpected(img.error());
+    }
+    fs::path temp_path = tempPathFor(repr_path);
+    img->write(temp_path.string());
+    std::error_code err;
+    fs::rename(temp_path, repr_path, err);
+    if(err)
+    {
+        fs::remove(temp_path, err);
+        return std::unexpected(std::format(
+            "Failed to write {}: {}", repr_path.string(), err.message()));
+    }
+    if(repr_type == Representation::THUMB)
+    {
+        storePlaceholder(path, makePlaceholder(*img));
+    }
+    return {};
+}
+
+E<PackBlob> ReprManager::getPacked(const fs::path& path)
+{
+    if(pack == nullptr)
+    {
+        return std::unexpected("Representation is not packed");
+    }
+    uint64_t key = outputKey(path);
+    auto blob = pack->get(key);
+    if(blob.has_value())
+    {
+        return *std::move(blob);
+    }
+    // A copy of the photo may have it generated already.
+    resolveSourceKey(path, config);
+    key = outputKey(path);
+    blob = pack->get(key);
+    if(blob.has_value())
+    {
+        return *std::move(blob);
+    }
+
+    PhaseTimer timer(RequestTimer::GENERATE);
+    spdlog::debug("Generating packed presentation for {}...", path.string());
+    Params p = params();
+    auto img = imgResize(path.string(), p.quality, p.size, previewTool(path));
+    if(!img.has_value())
+    {
+        return std::unexpected(img.error());
+    }
+    img->magick(std::string(ImageFormat::toMagick(p.format)));
+    Magick::Blob data;
+    img->write(&data);
+    auto status = pack->put(key, std::string_view(
+        static_cast<const char*>(data.data()), data.length()),
+        packSlot(path, false));
+    if(!status.has_value())
+    {
+        return std::unexpected(status.error());
+    }
+    if(repr_type == Representation::THUMB)
+    {
+        storePlaceholder(path, makePlaceholder(*img));
+    }
+    blob = pack->get(key);
+    if(!blob.has_value())
+    {
+        return std::unexpected("Failed to read back from pack");
+    }
+    return *std::move(blob);
+}
+
+std::optional<Placeholder> ReprManager::readPlaceholder(const fs::path& path)
+{
+    if(repr_type != Representation::THUMB)
+    {
+        return std::nullopt;
+    }
+    if(pack != nullptr)
+    {
+        auto blob = pack->get(placeholderKey(path));
+        if(!blob.has_value())
+        {
+            return std::nullopt;
+        }
+        return Placeholder::fromJson(nlohmann::json::parse(
+            blob->data, blob->data + blob->size, nullptr, false));
+    }
+    const fs::path placeholder_path = placeholderPath(path);
+    if(config.cache_dir.empty() && !isOutputCurrent(placeholder_path, path))
+    {
+        return std::nullopt;
+    }
+    auto data = readFile(placeholder_path);
+    if(!data.has_value())
+    {
+        return std::nullopt;
+    }
+    return Placeholder::fromJson(nlohmann::json::parse(*data, nullptr, false));
+}
+
+std::optional<Placeholder> ReprManager::loadPlaceholder(const fs::path& path)
+{
+    std::optional<Placeholder> result = readPlaceholder(path);
+    if(!result.has_value() && repr_type == Representation::THUMB)
+    {
+        // The thumbnail could be generated before placeholders were.
+        // Make one from the thumbnail, which is cheap to decode.
+        Magick::Image thumb;
+        try
+        {
+            if(pack != nullptr)
+            {
+                auto blob = pack->get(outputKey(path));
+                if(!blob.has_value())
+                {
+                    return std::nullopt;
+                }
+                thumb.read(Magick::Blob(blob->data, blob->size));
+            }
+            else
+            {
+                if(!isFresh(path))
+                {
+                    return std::nullopt;
+                }
+                thumb.read(getPath(path).string());
+            }
+        }
+        catch(Magick::Warning&) {}
+        catch(Magick::Error& e)
+        {
+            spdlog::warn("Failed to read thumbnail of {}: {}", path.string(),
+                         e.what());
+            return std::nullopt;
+        }
+        // This also passes it to the handler.
+        result = makePlaceholder(thumb);
+        storePlaceholder(path, *result);
+        return result;
+    }
+    if(result.has_value() && placeholder_handler)
+    {
+        placeholder_handler(path, *result);
+    }
+    return result;
+}
+
+bool ReprManager::isCached(const fs::path& path)
+{
+    if(pack != nullptr)
+    {
+        return pack->get(outputKey(path)).has_value();
+    }
+    return isFresh(path);
+}
+
+uint64_t ReprManager::outputKey(const fs::path& path) const
+{
+    return cacheKey(sourceKey(path, config), fingerprint());
+}
+
+uint64_t ReprManager::placeholderKey(const fs::path& path) const
+{
+    return cacheKey(sourceKey(path, config), fingerprint() + ":placeholder");
+}
+
+uint64_t ReprManager::packSlot(const fs::path& path, bool placeholder) const
+{
+    uint64_t hash = fnv1a(Representation::str(repr_type));
+    if(placeholder)
+    {
+        hash = fnv1a(":placeholder", hash);
+    }
+    return fnv1a(path.string(), hash);
+}
+
+fs::path ReprManager::placeholderPath(const fs::path& path) const
+{
+    if(!config.cache_dir.empty())
+    {
+        return shardedCachePath(config.cache_dir, sourceKey(path, config),
+                                fingerprint(), PLACEHOLDER_FILE_SUFFIX);
+    }
+    return path.parent_path() / RUNTIME_DATA_DIR /
+        (path.stem().string() + std::string(PLACEHOLDER_FILE_SUFFIX));
+}
+
+void ReprManager::storePlaceholder(const fs::path& path,
+                                   const Placeholder& placeholder)
+{
+    if(placeholder_handler)
+    {
+        placeholder_handler(path, placeholder);
+    }
+    const std::string data = placeholder.toJson().dump();
+    if(pack != nullptr)
+    {
+        auto status = pack->put(placeholderKey(path), data,
+                                packSlot(path, true));
+        if(!status.has_value())
+        {
+            spdlog::warn("Failed to store placeholder of {}: {}",
+                         path.string(), status.error());
+        }
+        return;
+    }
+    const fs::path result_path = placeholderPath(path);
+    const fs::path temp_path = tempPathFor(result_path);
+    std::ofstream out(temp_path);
+    out << data;
+    out.close();
+    std::error_code err;
+    if(out)
+    {
+        fs::rename(temp_path, result_path, err);
+    }
+    if(!out || err)
+    {
+        fs::remove(temp_path, err);
+        spdlog::warn("Failed to write placeholder of {}.", path.string());
+    }
+}
+
+void ReprManager::erasePacked(const fs::path& path)
+{
+    if(pack != nullptr)
+    {
+        pack->eraseSlot(packSlot(path, false));
+        pack->eraseSlot(packSlot(path, true));
+    }
+}
+
+void ReprManager::compactPack()
+{
+    if(pack == nullptr)
+    {
+        return;
+    }
+    auto status = pack->compact();
+    if(!status.has_value())
+    {
+        spdlog::error("Failed to compact pack: {}", status.error());
     }
-    return imgResize(std::move(path_str), repr_path.string(), quality, size);
 }
@@ -1,14 +1,71 @@
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <filesystem>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
 
 #include "config.hpp"
 #include "file_cache.hpp"
+#include "pack_store.hpp"
 #include "representation.hpp"
 #include "utils.hpp"
 
+// Placeholders are thumbnails scaled down to fit in this size.
+constexpr uint32_t PLACEHOLDER_SIZE = 12;
+constexpr int PLACEHOLDER_QUALITY = 40;
+// In the runtime data dir, the placeholder of photo “x.jpg” is stored
+// in “x” + this.
+constexpr std::string_view PLACEHOLDER_FILE_SUFFIX = "-placeholder.json";
+
+// A tiny version of a thumbnail to show while the thumbnail is
+// loading, small enough to be inlined in pages.
+struct Placeholder
+{
+    // Size of the thumbnail.
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::string data_uri;
+
+    nlohmann::json toJson() const;
+    static std::optional<Placeholder> fromJson(const nlohmann::json& data);
+};
+
+// Whether a file is a camera RAW file, judging from its name.
+bool isRawFile(std::string_view name);
+
+// Limit the total estimated memory of images being decoded at the
+// same time to “bytes”. Zero means unlimited. This must be called
+// before any image is generated.
+void setDecodeBudget(uint64_t bytes);
+
+// Number of thumbnails in a row of an album sprite. Each thumbnail
+// takes a square cell of the thumbnail size.
+constexpr uint32_t SPRITE_COLUMNS = 10;
+// In the runtime data dir, sprite file names start with this. Photo
+// IDs never start with “.”, so this does not clash with them.
+constexpr std::string_view SPRITE_FILE_PREFIX = ".sprite-";
+
+// Directory of the packs of thumbnails with “thumb_pack”.
+std::filesystem::path packDir(const Configuration& config);
+
+// Color of the blank parts of sprites in formats without
+// transparency. This is the background of the pages.
+constexpr std::string_view SPRITE_OPAQUE_BACKGROUND = "black";
+
+// Tile the encoded images in “tiles” into a sprite in “format”, each
+// centered in a cell of “cell_size”. Empty tiles are left blank,
+// which is transparent if the format allows.
+E<void> makeSprite(const std::vector<std::string_view>& tiles,
+                   uint32_t cell_size, int quality,
+                   ImageFormat::Value format, const std::string& result);
+
 class Representation
 {
 public:
@@ -45,15 +102,78 @@ public:
 class ReprManager: public FileCache
 {
 public:
-    ReprManager(Representation::Type type, const Configuration& conf);
+    // If “format” is set, it is used instead of the format in the
+    // config.
+    ReprManager(Representation::Type type, const Configuration& conf,
+                std::optional<ImageFormat::Value> format = std::nullopt);
     ~ReprManager() override = default;
 
+    // Whether the representations are stored in a pack. If so, use
+    // getPacked() instead of get().
+    bool isPacked() const { return pack != nullptr; }
+    E<PackBlob> getPacked(const std::filesystem::path& path);
+    // Erase the packed representation of “path”, which is deleted.
+    void erasePacked(const std::filesystem::path& path);
+    void compactPack();
+    // Identify the parameters used to generate the representation.
+    std::string fingerprint() const;
+    // Key of the representation of “path”. Representations of copies
+    // of a photo share the key with “content_dedup”.
+    uint64_t outputKey(const std::filesystem::path& path) const;
+    // Return the stored placeholder of the thumbnail of “path”, if
+    // there is one. Placeholders are made when thumbnails are
+    // generated. Only for thumbnails.
+    std::optional<Placeholder> readPlaceholder(
+        const std::filesystem::path& path);
+    // Like readPlaceholder(), but if there is no stored placeholder
+    // and the thumbnail is generated, make one from the thumbnail.
+    // This decodes the thumbnail, so it should be run in the job
+    // queue.
+    std::optional<Placeholder> loadPlaceholder(
+        const std::filesystem::path& path);
+    // Call “handler” with each placeholder that is made or loaded.
+    void setPlaceholderHandler(
+        std::function<void(const std::filesystem::path&, const Placeholder&)>
+        handler)
+    {
+        placeholder_handler = std::move(handler);
+    }
+    // Whether the representation of “path” is generated and up to
+    // date.
+    bool isCached(const std::filesystem::path& path);
+
 protected:
     std::filesystem::path getPath(const std::filesystem::path& path) override;
     bool isFresh(const std::filesystem::path& path) override;
     E<void> refresh(const std::filesystem::path& path) override;
 
 private:
+    struct Params
+    {
+        ImageFormat::Value format;
+        int quality;
+        uint32_t size;
+    };
+
+    Params params() const;
+    // The exiftool to read embedded previews of “path” with, or empty
+    // if they should not be used.
+    std::string_view previewTool(const std::filesystem::path& path) const;
+    uint64_t placeholderKey(const std::filesystem::path& path) const;
+    // Slot of the representation of “path” in the pack, or of its
+    // placeholder. A new blob in the slot supersedes the old one, for
+    // example after the photo or the config changes.
+    uint64_t packSlot(const std::filesystem::path& path,
+                      bool placeholder) const;
+    std::filesystem::path placeholderPath(
+        const std::filesystem::path& path) const;
+    void storePlaceholder(const std::filesystem::path& path,
+                          const Placeholder& placeholder);
+
     Representation::Type repr_type;
     const Configuration& config;
+    std::optional<ImageFormat::Value> format_override;
+    std::unique_ptr<PackStore> pack;
+    std::function<void(const std::filesystem::path&, const Placeholder&)>
+    placeholder_handler;
 };
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <string_view>
+#include <utility>
+
+// Time spent in each phase of handling a request, for the access
+// log. A request is handled by one thread, so the timer of the
+// current request is thread-local. Phases can nest (e.g. resolving
+// access status while refreshing a listing), in which case the time
+// is counted in both.
+class RequestTimer
+{
+public:
+    enum Phase { LISTING, STATUS, METADATA, GENERATE, RENDER, PHASE_COUNT };
+    using Clock = std::chrono::steady_clock;
+
+    static std::string_view phaseName(Phase p)
+    {
+        switch(p)
+        {
+        case LISTING:
+            return "listing";
+        case STATUS:
+            return "status";
+        case METADATA:
+            return "metadata";
+        case GENERATE:
+            return "generate";
+        case RENDER:
+            return "render";
+        case PHASE_COUNT:
+            break;
+        }
+        std::unreachable();
+    }
+
+    static RequestTimer& current()
+    {
+        thread_local RequestTimer timer;
+        return timer;
+    }
+
+    // Start timing a new request on this thread.
+    static void start()
+    {
+        RequestTimer& timer = current();
+        timer.begin = Clock::now();
+        timer.phases.fill(Clock::duration::zero());
+        timer.streamed = 0;
+    }
+
+    void add(Phase p, Clock::duration d) { phases[p] += d; }
+    // Count bytes of a streamed response, which has no body or
+    // Content-Length to tell its size.
+    void addStreamed(size_t bytes) { streamed += bytes; }
+    size_t streamedBytes() const { return streamed; }
+    Clock::duration phase(Phase p) const { return phases[p]; }
+    Clock::duration total() const { return Clock::now() - begin; }
+
+private:
+    Clock::time_point begin;
+    std::array<Clock::duration, PHASE_COUNT> phases{};
+    size_t streamed = 0;
+};
+
+// Add the time spent in a scope to a phase of the current request.
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(RequestTimer::Phase p)
+            : phase(p), begin(RequestTimer::Clock::now())
+    {
+    }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+    ~PhaseTimer()
+    {
+        RequestTimer::current().add(phase,
+                                    RequestTimer::Clock::now() - begin);
+    }
+
+private:
+    RequestTimer::Phase phase;
+    RequestTimer::Clock::time_point begin;
+};
@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "metadata.hpp"
+#include "search_index.hpp"
+
+namespace fs = std::filesystem;
+
+std::vector<std::string> searchWords(std::string_view text)
+{
+    std::vector<std::string> words;
+    std::string word;
+    for(char c: text)
+    {
+        const auto byte = static_cast<unsigned char>(c);
+        if(byte >= 0x80 || std::isalnum(byte))
+        {
+            word.push_back(static_cast<char>(std::tolower(byte)));
+        }
+        else if(!word.empty())
+        {
+            words.push_back(std::move(word));
+            word.clear();
+        }
+    }
+    if(!word.empty())
+    {
+        words.push_back(std::move(word));
+    }
+    return words;
+}
+
+// Sort “words” and remove duplicates.
+void uniqueWords(std::vector<std::string>& words)
+{
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+}
+
+// Words of a photo that do not come from its metadata.
+std::vector<std::string> idWords(const std::string& id)
+{
+    std::vector<std::string> words = searchWords(id);
+    uniqueWords(words);
+    return words;
+}
+
+uint64_t SearchIndex::beginWalk()
+{
+    std::unique_lock<std::shared_mutex> l(lock);
+    return ++last_walk;
+}
+
+void SearchIndex::endWalk(uint64_t walk)
+{
+    std::unique_lock<std::shared_mutex> l(lock);
+    // Many photos may be gone at once (e.g. a removed album), so the
+    // postings are filtered in one pass, instead of per photo.
+    std::vector<bool> removed(docs.size(), false);
+    bool any_removed = false;
+    for(DocNumber number = 0; number < docs.size(); number++)
+    {
+        Doc& doc = docs[number];
+        if(doc.id.empty() || doc.walk >= walk)
+        {
+            continue;
+        }
+        removed[number] = true;
+        any_removed = true;
+        doc_numbers.erase(doc.id);
+        doc = Doc();
+        free_docs.push_back(number);
+    }
+    rankDocs();
+    if(!any_removed)
+    {
+        return;
+    }
+    for(auto it = postings.begin(); it != postings.end();)
+    {
+        std::erase_if(it->second, [&](DocNumber number)
+        {
+            return removed[number];
+        });
+        if(it->second.empty())
+        {
+            it = postings.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void SearchIndex::add(const std::string& id, uint64_t walk)
+{
+    std::unique_lock<std::shared_mutex> l(lock);
+    addLocked(id, walk);
+}
+
+void SearchIndex::add(const std::string& id)
+{
+    std::unique_lock<std::shared_mutex> l(lock);
+    // A walk in progress has the latest number, so the photo survives
+    // its end.
+    addLocked(id, last_walk);
+}
+
+void SearchIndex::addLocked(const std::string& id, uint64_t walk)
+{
+    auto found = doc_numbers.find(id);
+    if(found != doc_numbers.end())
+    {
+        docs[found->second].walk = walk;
+        return;
+    }
+    DocNumber number;
+    if(free_docs.empty())
+    {
+        number = docs.size();
+        docs.emplace_back();
+    }
+    else
+    {
+        number = free_docs.back();
+        free_docs.pop_back();
+    }
+    docs[number].id = id;
+    docs[number].walk = walk;
+    doc_numbers.emplace(id, number);
+    setWords(number, idWords(id));
+}
+
+void SearchIndex::updateMetadata(const std::string& id,
+                                 const PhotoMetadata& metadata,
+                                 fs::file_time_type mtime)
+{
+    std::vector<std::string> words = idWords(id);
+    for(const std::string* field: {
+            &metadata.make, &metadata.model, &metadata.lens,
+            &metadata.headline, &metadata.title, &metadata.caption})
+    {
+        std::vector<std::string> field_words = searchWords(*field);
+        std::move(field_words.begin(), field_words.end(),
+                  std::back_inserter(words));
+    }
+    uniqueWords(words);
+
+    std::unique_lock<std::shared_mutex> l(lock);
+    auto found = doc_numbers.find(id);
+    if(found == doc_numbers.end())
+    {
+        return;
+    }
+    setWords(found->second, std::move(words));
+    docs[found->second].metadata_time = mtime;
+}
+
+std::optional<fs::file_time_type>
+SearchIndex::metadataTime(const std::string& id) const
+{
+    std::shared_lock<std::shared_mutex> l(lock);
+    auto found = doc_numbers.find(id);
+    if(found == doc_numbers.end())
+    {
+        return std::nullopt;
+    }
+    return docs[found->second].metadata_time;
+}
+
+SearchIndex::Result SearchIndex::search(std::string_view query, size_t offset,
+                                        size_t limit) const
+{
+    std::vector<std::string> words = searchWords(query);
+    uniqueWords(words);
+    if(words.empty())
+    {
+        return {};
+    }
+
+    std::shared_lock<std::shared_mutex> l(lock);
+    std::vector<const std::vector<DocNumber>*> lists;
+    for(const std::string& word: words)
+    {
+        auto found = postings.find(word);
+        if(found == postings.end())
+        {
+            return {};
+        }
+        lists.push_back(&found->second);
+    }
+    // Start from the rarest word, and look up the others in it.
+    std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b)
+    {
+        return a->size() < b->size();
+    });
+    std::vector<DocNumber> matches = *lists.front();
+    for(size_t i = 1; i < lists.size() && !matches.empty(); i++)
+    {
+        const std::vector<DocNumber>& list = *lists[i];
+        if(list.size() / matches.size() < 16)
+        {
+            std::vector<DocNumber> both;
+            std::set_intersection(matches.begin(), matches.end(),
+                                  list.begin(), list.end(),
+                                  std::back_inserter(both));
+            matches = std::move(both);
+        }
+        else
+        {
+            std::erase_if(matches, [&](DocNumber number)
+            {
+                return !std::binary_search(list.begin(), list.end(), number);
+            });
+        }
+    }
+
+    Result result;
+    result.total = matches.size();
+    if(offset >= matches.size())
+    {
+        return result;
+    }
+    // Only the matches up to the requested page need to be in order.
+    const size_t end = std::min(matches.size(), offset + limit);
+    std::partial_sort(matches.begin(), matches.begin() + end, matches.end(),
+                      [&](DocNumber a, DocNumber b)
+                      {
+                          if(docs[a].rank != docs[b].rank)
+                          {
+                              return docs[a].rank < docs[b].rank;
+                          }
+                          return docs[a].id < docs[b].id;
+                      });
+    for(size_t i = offset; i < end; i++)
+    {
+        result.ids.push_back(docs[matches[i]].id);
+    }
+    return result;
+}
+
+size_t SearchIndex::size() const
+{
+    std::shared_lock<std::shared_mutex> l(lock);
+    return doc_numbers.size();
+}
+
+void SearchIndex::setWords(DocNumber number, std::vector<std::string>&& words)
+{
+    std::vector<std::string>& old_words = docs[number].words;
+    std::vector<std::string> removed;
+    std::set_difference(old_words.begin(), old_words.end(), words.begin(),
+                        words.end(), std::back_inserter(removed));
+    std::vector<std::string> added;
+    std::set_difference(words.begin(), words.end(), old_words.begin(),
+                        old_words.end(), std::back_inserter(added));
+    for(const std::string& word: removed)
+    {
+        auto found = postings.find(word);
+        if(found == postings.end())
+        {
+            continue;
+        }
+        std::vector<DocNumber>& list = found->second;
+        auto pos = std::lower_bound(list.begin(), list.end(), number);
+        if(pos != list.end() && *pos == number)
+        {
+            list.erase(pos);
+        }
+        if(list.empty())
+        {
+            postings.erase(found);
+        }
+    }
+    for(const std::string& word: added)
+    {
+        std::vector<DocNumber>& list = postings[word];
+        auto pos = std::lower_bound(list.begin(), list.end(), number);
+        if(pos == list.end() || *pos != number)
+        {
+            list.insert(pos, number);
+        }
+    }
+    old_words = std::move(words);
+}
+
+void SearchIndex::rankDocs()
+{
+    std::vector<DocNumber> order;
+    order.reserve(doc_numbers.size());
+    for(DocNumber number = 0; number < docs.size(); number++)
+    {
+        if(!docs[number].id.empty())
+        {
+            order.push_back(number);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](DocNumber a, DocNumber b)
+    {
+        return docs[a].id < docs[b].id;
+    });
+    for(uint32_t rank = 0; rank < order.size(); rank++)
+    {
+        docs[order[rank]].rank = rank;
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "metadata.hpp"
+
+// Split “text” into lower-cased words for searching. Words are
+// separated by anything other than ASCII letters and digits.
+// Non-ASCII bytes are kept in words, so that UTF-8 text is split at
+// ASCII punctuation and spaces only.
+std::vector<std::string> searchWords(std::string_view text);
+
+// An in-memory inverted index of photos, by the words in their IDs
+// (album names and file names) and in their metadata. A photo matches
+// a query if it has all the words of the query.
+class SearchIndex
+{
+public:
+    struct Result
+    {
+        // Number of all matching photos.
+        size_t total = 0;
+        // IDs of the requested page of matching photos, sorted.
+        std::vector<std::string> ids;
+    };
+
+    SearchIndex() = default;
+    SearchIndex(const SearchIndex&) = delete;
+    SearchIndex& operator=(const SearchIndex&) = delete;
+
+    // Start a walk of the photo tree. Photos not added during the
+    // walk are removed from the index by endWalk().
+    uint64_t beginWalk();
+    void endWalk(uint64_t walk);
+    // Add photo “id” to the index in walk “walk”, or mark it as seen
+    // if it is already in the index.
+    void add(const std::string& id, uint64_t walk);
+    // Add photo “id” to the index outside of a walk (e.g. when it is
+    // found by the file watcher). It is kept until a walk that starts
+    // after this does not find it.
+    void add(const std::string& id);
+    // Update the metadata of photo “id”, whose metadata file has
+    // modification time “mtime”. Photos not in the index are ignored,
+    // so that only photos found in the walk (which does not go into
+    // hidden albums) are ever searchable.
+    void updateMetadata(const std::string& id, const PhotoMetadata& metadata,
+                        std::filesystem::file_time_type mtime);
+    // Modification time of the metadata file indexed for photo “id”.
+    std::optional<std::filesystem::file_time_type>
+    metadataTime(const std::string& id) const;
+
+    Result search(std::string_view query, size_t offset, size_t limit) const;
+    size_t size() const;
+
+private:
+    using DocNumber = uint32_t;
+    static constexpr uint32_t UNRANKED = ~0u;
+
+    struct Doc
+    {
+        std::string id;
+        // Sorted and unique.
+        std::vector<std::string> words;
+        std::optional<std::filesystem::file_time_type> metadata_time;
+        uint64_t walk = 0;
+        // Position of the ID in the sorted IDs of all documents, so
+        // that results are sorted without comparing strings. Documents
+        // added after the last ranking come last.
+        uint32_t rank = UNRANKED;
+    };
+
+
+    // Replace the words of document “number” with “words”.
+    void setWords(DocNumber number, std::vector<std::string>&& words);
+    // Like add(), but “lock” is held by the caller.
+    void addLocked(const std::string& id, uint64_t walk);
+    // Update the ranks of all documents.
+    void rankDocs();
+
+    // Removed documents are empty and their numbers are reused.
+    std::vector<Doc> docs;
+    std::vector<DocNumber> free_docs;
+    std::unordered_map<std::string, DocNumber> doc_numbers;
+    // Document numbers of each word, sorted.
+    std::unordered_map<std::string, std::vector<DocNumber>> postings;
+    uint64_t last_walk = 0;
+    mutable std::shared_mutex lock;
+};
@@ -0,0 +1,82 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include "pack_store.hpp"
+#include "snapshot.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+
+// Bump the number when the content of the snapshot changes.
+constexpr std::string_view SNAPSHOT_MAGIC = "NSGSNAP4";
+
+E<void> writeSnapshot(const fs::path& path, const nlohmann::json& snapshot)
+{
+    std::vector<std::uint8_t> data = nlohmann::json::to_cbor(snapshot);
+    fs::path temp_path = tempPathFor(path);
+    {
+        std::ofstream out(temp_path, std::ios::binary);
+        out.write(SNAPSHOT_MAGIC.data(), SNAPSHOT_MAGIC.size());
+        out.write(reinterpret_cast<const char*>(data.data()), data.size());
+        if(!out)
+        {
+            std::error_code err;
+            fs::remove(temp_path, err);
+            return std::unexpected(std::format(
+                "Failed to write {}", temp_path.string()));
+        }
+    }
+    std::error_code err;
+    fs::rename(temp_path, path, err);
+    if(err)
+    {
+        return std::unexpected(std::format("Failed to rename {}: {}",
+                                           temp_path.string(), err.message()));
+    }
+    return {};
+}
+
+E<nlohmann::json> readSnapshot(const fs::path& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return std::unexpected(std::format("Failed to open {}: {}",
+                                           path.string(), std::strerror(errno)));
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        return std::unexpected(std::format("Failed to stat {}: {}",
+                                           path.string(), std::strerror(errno)));
+    }
+    FileMapping mapping(fd, info.st_size);
+    ::close(fd);
+
+    std::string_view content(mapping.data(), mapping.size());
+    if(!content.starts_with(SNAPSHOT_MAGIC))
+    {
+        return std::unexpected("Unknown snapshot version");
+    }
+    content.remove_prefix(SNAPSHOT_MAGIC.size());
+    nlohmann::json snapshot = nlohmann::json::from_cbor(
+        content.begin(), content.end(), true, false);
+    if(snapshot.is_discarded())
+    {
+        return std::unexpected("Corrupted snapshot");
+    }
+    return snapshot;
+}
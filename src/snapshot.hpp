@@ -0,0 +1,19 @@
+#pragma once
+
+#include <filesystem>
+
+#include <nlohmann/json.hpp>
+
+#include "utils.hpp"
+
+// A snapshot of in-memory caches, saved on shutdown and loaded on
+// startup, so that a restarted server does not have to rebuild them
+// from scratch. The file is a magic string with the format version,
+// followed by the snapshot in CBOR. Snapshots of other versions are
+// ignored.
+
+// Write “snapshot” to “path”, replacing the old one atomically.
+E<void> writeSnapshot(const std::filesystem::path& path,
+                      const nlohmann::json& snapshot);
+// Read the snapshot at “path”.
+E<nlohmann::json> readSnapshot(const std::filesystem::path& path);
@@ -0,0 +1,191 @@
+#include <filesystem>
+#include <format>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "compression.hpp"
+#include "config.hpp"
+#include "static_assets.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+
+std::string_view staticContentType(const fs::path& path)
+{
+    const std::string ext = asciiLower(path.extension().string());
+    if(ext == ".css")
+    {
+        return "text/css";
+    }
+    if(ext == ".svg")
+    {
+        return "image/svg+xml";
+    }
+    if(ext == ".js")
+    {
+        return "text/javascript";
+    }
+    if(ext == ".html")
+    {
+        return "text/html";
+    }
+    if(ext == ".json")
+    {
+        return "application/json";
+    }
+    if(ext == ".txt")
+    {
+        return "text/plain";
+    }
+    if(ext == ".png")
+    {
+        return "image/png";
+    }
+    if(ext == ".jpg" || ext == ".jpeg")
+    {
+        return "image/jpeg";
+    }
+    if(ext == ".webp")
+    {
+        return "image/webp";
+    }
+    if(ext == ".ico")
+    {
+        return "image/x-icon";
+    }
+    if(ext == ".woff2")
+    {
+        return "font/woff2";
+    }
+    return "application/octet-stream";
+}
+
+bool isCompressible(std::string_view content_type)
+{
+    return content_type.starts_with("text/") ||
+        content_type == "image/svg+xml" || content_type == "application/json";
+}
+
+std::optional<std::string_view> StaticAsset::variant(
+    ContentEncoding::Value encoding) const
+{
+    switch(encoding)
+    {
+    case ContentEncoding::IDENTITY:
+        return content;
+    case ContentEncoding::GZIP:
+        if(!gzip.empty())
+        {
+            return gzip;
+        }
+        break;
+    case ContentEncoding::BROTLI:
+        if(!brotli.empty())
+        {
+            return brotli;
+        }
+        break;
+    }
+    return std::nullopt;
+}
+
+StaticAssets::StaticAssets(const Configuration& conf) : config(conf)
+{
+    std::error_code err;
+    fs::recursive_directory_iterator it(config.static_dir, err);
+    if(err)
+    {
+        spdlog::error("Failed to read static dir {}: {}", config.static_dir,
+                      err.message());
+        return;
+    }
+    for(const fs::directory_entry& entry: it)
+    {
+        if(entry.is_regular_file(err))
+        {
+            load(fs::relative(entry.path(), config.static_dir).string());
+        }
+    }
+    spdlog::info("Loaded {} static files from {}.", assets.size(),
+                 config.static_dir);
+}
+
+void StaticAssets::load(const std::string& path)
+{
+    auto content = readFile(fs::path(config.static_dir) / path);
+    if(!content.has_value())
+    {
+        spdlog::error(content.error());
+        return;
+    }
+    StaticAsset asset;
+    asset.content.assign(content->begin(), content->end());
+    asset.content_type = staticContentType(path);
+    asset.hash = std::format("{:012x}", fnv1a(asset.content) >> 16);
+    if(isCompressible(asset.content_type))
+    {
+        // Compressed once with the highest levels, since this is not
+        // done per request.
+        Configuration levels = config;
+        levels.gzip_level = 9;
+        levels.brotli_level = 11;
+        for(auto encoding: {ContentEncoding::GZIP, ContentEncoding::BROTLI})
+        {
+            auto compressed = compress(asset.content, encoding, levels);
+            if(!compressed.has_value() ||
+               compressed->size() >= asset.content.size())
+            {
+                continue;
+            }
+            if(encoding == ContentEncoding::GZIP)
+            {
+                asset.gzip = *std::move(compressed);
+            }
+            else
+            {
+                asset.brotli = *std::move(compressed);
+            }
+        }
+    }
+
+    fs::path p(path);
+    std::string fingerprinted = (p.parent_path() / std::format(
+        "{}.{}{}", p.stem().string(), asset.hash,
+        p.extension().string())).string();
+    fingerprinted_paths[fingerprinted] = path;
+    fingerprints[path] = std::move(fingerprinted);
+    assets.insert_or_assign(path, std::move(asset));
+}
+
+const StaticAsset* StaticAssets::find(const std::string& path,
+                                      bool& fingerprinted) const
+{
+    std::string real_path = path;
+    auto original = fingerprinted_paths.find(path);
+    fingerprinted = original != fingerprinted_paths.end();
+    if(fingerprinted)
+    {
+        real_path = original->second;
+    }
+    auto found = assets.find(real_path);
+    if(found == assets.end())
+    {
+        return nullptr;
+    }
+    return &found->second;
+}
+
+std::string StaticAssets::fingerprintedPath(const std::string& path) const
+{
+    auto found = fingerprints.find(path);
+    if(found == fingerprints.end())
+    {
+        return path;
+    }
+    return found->second;
+}
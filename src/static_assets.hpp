@@ -0,0 +1,60 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "compression.hpp"
+#include "config.hpp"
+
+// A file in the static dir, kept in memory.
+struct StaticAsset
+{
+    std::string content_type;
+    std::string content;
+    // Precompressed variants. Empty if compression does not make the
+    // file smaller, or the file is not text.
+    std::string gzip;
+    std::string brotli;
+    // Hex hash of the content, used in the fingerprinted path and
+    // the ETags.
+    std::string hash;
+
+    // The content in “encoding”, or nullopt if there is no such
+    // variant.
+    std::optional<std::string_view> variant(
+        ContentEncoding::Value encoding) const;
+};
+
+// All files in the static dir, loaded into memory at startup. Each
+// file is served both at its path and at a fingerprinted path with
+// the hash of its content before the extension (e.g.
+// “style.0123456789ab.css”). As the content at a fingerprinted path
+// never changes, it can be cached by browsers forever.
+class StaticAssets
+{
+public:
+    StaticAssets() = delete;
+    explicit StaticAssets(const Configuration& conf);
+    StaticAssets(const StaticAssets&) = delete;
+    StaticAssets& operator=(const StaticAssets&) = delete;
+
+    // Find the asset at “path” relative to the static dir.
+    // “fingerprinted” tells whether the path is a fingerprinted one.
+    const StaticAsset* find(const std::string& path,
+                            bool& fingerprinted) const;
+    // Return the fingerprinted path of the asset at “path”, or “path”
+    // itself if there is no such asset.
+    std::string fingerprintedPath(const std::string& path) const;
+
+private:
+    void load(const std::string& path);
+
+    const Configuration& config;
+    std::unordered_map<std::string, StaticAsset> assets;
+    // Fingerprinted path -> path
+    std::unordered_map<std::string, std::string> fingerprinted_paths;
+    // Path -> fingerprinted path
+    std::unordered_map<std::string, std::string> fingerprints;
+};
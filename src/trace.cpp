@@ -0,0 +1,150 @@
+#ifdef NSGALLERY_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+// Number of events kept per thread. Older events are overwritten.
+constexpr size_t TRACE_BUFFER_SIZE = 1 << 16;
+
+struct TraceEvent
+{
+    const char* name;
+    int64_t begin_us;
+    int64_t duration_us;
+};
+
+// The buffer is only written by its thread, but it is read by
+// whichever thread dumps the trace, which is rare. The lock is
+// therefore almost never contended.
+struct TraceBuffer
+{
+    std::mutex lock;
+    std::vector<TraceEvent> events;
+    size_t next = 0;
+    uint64_t thread_id = 0;
+};
+
+std::mutex trace_buffers_lock;
+// Buffers are kept after their threads exit, so that the events are
+// still in the dump.
+std::vector<std::shared_ptr<TraceBuffer>> trace_buffers;
+
+TraceBuffer& threadTraceBuffer()
+{
+    thread_local std::shared_ptr<TraceBuffer> buffer = []
+    {
+        static std::atomic<uint64_t> thread_count = 0;
+        auto b = std::make_shared<TraceBuffer>();
+        b->events.reserve(TRACE_BUFFER_SIZE);
+        b->thread_id = ++thread_count;
+        std::lock_guard<std::mutex> l(trace_buffers_lock);
+        trace_buffers.push_back(b);
+        return b;
+    }();
+    return *buffer;
+}
+
+int64_t toMicros(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+TraceScope::~TraceScope()
+{
+    auto end = std::chrono::steady_clock::now();
+    TraceEvent event{name, toMicros(begin.time_since_epoch()),
+                     toMicros(end - begin)};
+    TraceBuffer& buffer = threadTraceBuffer();
+    std::lock_guard<std::mutex> l(buffer.lock);
+    if(buffer.events.size() < TRACE_BUFFER_SIZE)
+    {
+        buffer.events.push_back(event);
+    }
+    else
+    {
+        buffer.events[buffer.next] = event;
+    }
+    buffer.next = (buffer.next + 1) % TRACE_BUFFER_SIZE;
+}
+
+std::string traceToJson()
+{
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> l(trace_buffers_lock);
+        buffers = trace_buffers;
+    }
+    const int pid = getpid();
+    nlohmann::json events = nlohmann::json::value_t::array;
+    for(const auto& buffer: buffers)
+    {
+        std::lock_guard<std::mutex> l(buffer->lock);
+        for(const TraceEvent& event: buffer->events)
+        {
+            events.push_back({
+                {"name", event.name}, {"ph", "X"}, {"ts", event.begin_us},
+                {"dur", event.duration_us}, {"pid", pid},
+                {"tid", buffer->thread_id}});
+        }
+    }
+    nlohmann::json trace = {{"traceEvents", std::move(events)},
+                            {"displayTimeUnit", "ms"}};
+    return trace.dump();
+}
+
+volatile std::sig_atomic_t trace_dump_requested = 0;
+
+void onTraceSignal([[maybe_unused]] int signal)
+{
+    trace_dump_requested = 1;
+}
+
+void installTraceSignalHandler(const fs::path& path)
+{
+    // Nothing much can be done in a signal handler, so it only sets a
+    // flag, which is checked by a thread.
+    static std::jthread watcher([path](std::stop_token stop)
+    {
+        while(!stop.stop_requested())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            if(trace_dump_requested == 0)
+            {
+                continue;
+            }
+            trace_dump_requested = 0;
+            std::ofstream out(path);
+            out << traceToJson();
+            if(out)
+            {
+                spdlog::info("Dumped trace to {}.", path.string());
+            }
+            else
+            {
+                spdlog::error("Failed to dump trace to {}.", path.string());
+            }
+        }
+    });
+    std::signal(SIGUSR1, onTraceSignal);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+// Scoped trace events for profiling, enabled by building with the
+// CMake option NSGALLERY_TRACE. Events are recorded into a ring buffer
+// per thread, and can be dumped as Chrome trace JSON (viewable in
+// chrome://tracing or Perfetto). When tracing is disabled, TRACE_SCOPE
+// expands to nothing.
+
+#ifdef NSGALLERY_TRACE
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+// Record the time spent in the enclosing scope as an event named
+// “name”, which must be a string literal.
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_CONCAT_INNER(a, b) a##b
+
+class TraceScope
+{
+public:
+    TraceScope() = delete;
+    explicit TraceScope(const char* name)
+            : name(name), begin(std::chrono::steady_clock::now())
+    {
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+    ~TraceScope();
+
+private:
+    const char* name;
+    std::chrono::steady_clock::time_point begin;
+};
+
+// Return the events of all threads as Chrome trace JSON.
+std::string traceToJson();
+// Dump the trace to “path” when the process receives SIGUSR1.
+void installTraceSignalHandler(const std::filesystem::path& path);
+
+#else
+
+#define TRACE_SCOPE(name) do {} while(false)
+
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <charconv>
+#include <cstdint>
 #include <expected>
 #include <filesystem>
 #include <format>
@@ -8,8 +9,11 @@
 #include <iterator>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include <unistd.h>
+
 #include <ryml.hpp>
 #include <ryml_std.hpp>
 
@@ -26,6 +30,23 @@ inline bool getYamlValue(ryml::ConstNodeRef node, T& result)
     return status.ec == std::errc();
 }
 
+inline bool getYamlBool(ryml::ConstNodeRef node, bool& result)
+{
+    auto value = node.val();
+    std::string s(value.begin(), value.end());
+    if(s == "true" || s == "yes" || s == "on")
+    {
+        result = true;
+        return true;
+    }
+    if(s == "false" || s == "no" || s == "off")
+    {
+        result = false;
+        return true;
+    }
+    return false;
+}
+
 inline E<std::vector<char>> readFile(const std::filesystem::path& path)
 {
     std::ifstream f(path, std::ios::binary);
@@ -41,6 +62,20 @@ inline E<std::vector<char>> readFile(const std::filesystem::path& path)
     return content;
 }
 
+// Prefix of the names of files that are being written.
+constexpr std::string_view TEMP_FILE_PREFIX = ".tmp-";
+
+// A path next to “path” to write to before renaming it to “path”,
+// so that readers (possibly in other processes) never see a partial
+// file. It is hidden, unique to the thread, and keeps the extension.
+inline std::filesystem::path tempPathFor(const std::filesystem::path& path)
+{
+    return path.parent_path() / std::format(
+        "{}{}-{}-{}", TEMP_FILE_PREFIX, getpid(),
+        std::hash<std::thread::id>{}(std::this_thread::get_id()),
+        path.filename().string());
+}
+
 // Convert a string to lower case, assuming ASCII.
 inline std::string asciiLower(std::string s)
 {
@@ -48,3 +83,48 @@ inline std::string asciiLower(std::string s)
                    [](unsigned char c){ return std::tolower(c); });
     return s;
 }
+
+// Escape “s” for use in HTML text and attribute values.
+inline std::string htmlEscape(std::string_view s)
+{
+    std::string result;
+    result.reserve(s.size());
+    for(char c: s)
+    {
+        switch(c)
+        {
+        case '&':
+            result += "&amp;";
+            break;
+        case '<':
+            result += "&lt;";
+            break;
+        case '>':
+            result += "&gt;";
+            break;
+        case '"':
+            result += "&quot;";
+            break;
+        case '\'':
+            result += "&#39;";
+            break;
+        default:
+            result.push_back(c);
+        }
+    }
+    return result;
+}
+
+// 64-bit FNV-1a hash. This is stable across runs and platforms, which
+// makes it suitable for on-disk cache keys. Pass the previous result
+// as “hash” to hash several pieces of data together.
+inline uint64_t fnv1a(std::string_view data,
+                      uint64_t hash = 0xcbf29ce484222325ull)
+{
+    for(unsigned char c: data)
+    {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}